@@ -0,0 +1,307 @@
+#pragma once
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "stack.h"
+
+namespace cxx {
+
+    // A stack with the semantics of cxx::stack for producer-consumer
+    // pipelines whose consumers are coroutines. co_await async_pop()
+    // suspends the consumer until there is an element (async_pop(k):
+    // an element with the key k), and then pops and returns it.
+    //
+    // Every operation takes a single mutex. A push hands its elements
+    // to the waiting consumers, in the order they started waiting,
+    // before it releases the mutex, and then resumes them on its own
+    // thread, so a push_range wakes every consumer it feeds at once.
+    // A consumer is only resumed with its element already popped, so
+    // it never finds the stack empty again.
+    //
+    // A suspended consumer must not be destroyed before it is resumed.
+    template <class K, class V, class Policy = stack_policy>
+    class async_stack {
+        struct waiter_t;
+    public:
+        class pop_awaiter;
+        class key_pop_awaiter;
+
+        async_stack() = default;
+        async_stack(const async_stack&) = delete;
+        async_stack& operator=(const async_stack&) = delete;
+
+        void push(const K&, const V&);
+        void push(const K&, V&&);
+        // Pushes the (key, value) pairs from [first, last), in order,
+        // and then wakes the consumers.
+        template <class InputIt>
+        void push_range(InputIt, InputIt);
+
+        // Awaitables returning the popped element (value). If taking
+        // the element throws, so does the co_await, and the element
+        // stays on the stack.
+        pop_awaiter async_pop();
+        key_pop_awaiter async_pop(const K&);
+        // Pop the front element (with the given key) if there is one.
+        std::optional<std::pair<K, V>> try_pop();
+        std::optional<V> try_pop(const K&);
+
+        size_t size() const;
+        size_t count(const K&) const;
+        // The number of suspended consumers.
+        size_t waiting() const;
+
+    private:
+        using result_t = std::optional<std::pair<K, V>>;
+
+        mutable std::mutex lock;
+        stack<K, V, Policy> elements;
+        // The suspended consumers, in the order they started waiting.
+        waiter_t* first = nullptr;
+        waiter_t* last = nullptr;
+        size_t waiters = 0;
+
+        // Pops the front element (with the key, if given) into result,
+        // or returns false if there is none. The lock must be held.
+        bool take(const std::optional<K>&, result_t&);
+        // Unlinks the consumers that can take an element now, gives them
+        // their elements, and returns them, linked in their order.
+        waiter_t* dispatch() noexcept;
+        // Calls push(stack&) and wakes the consumers.
+        template <class F>
+        void push_and_wake(F&&);
+    };
+
+    // The part of an awaiter linked into the list of consumers.
+    template <class K, class V, class Policy>
+    struct async_stack<K, V, Policy>::waiter_t {
+        async_stack* owner;
+        // Empty for any key.
+        std::optional<K> key;
+        result_t result;
+        std::exception_ptr error;
+        std::coroutine_handle<> handle;
+        waiter_t* next;
+
+        waiter_t(async_stack&, std::optional<K>);
+
+        bool await_ready() const noexcept;
+        // Takes the element right away if there is one.
+        bool await_suspend(std::coroutine_handle<>);
+    };
+
+    template <class K, class V, class Policy>
+    class async_stack<K, V, Policy>::pop_awaiter : public waiter_t {
+    public:
+        std::pair<K, V> await_resume();
+
+    private:
+        friend class async_stack;
+
+        explicit pop_awaiter(async_stack&);
+    };
+
+    template <class K, class V, class Policy>
+    class async_stack<K, V, Policy>::key_pop_awaiter : public waiter_t {
+    public:
+        V await_resume();
+
+    private:
+        friend class async_stack;
+
+        key_pop_awaiter(async_stack&, const K&);
+    };
+
+    // ---------- Implementations ---------- //
+
+    template <class K, class V, class Policy>
+    void async_stack<K, V, Policy>::push(const K& key, const V& value) {
+        push_and_wake([&](stack<K, V, Policy>& s) { s.push(key, value); });
+    }
+
+    template <class K, class V, class Policy>
+    void async_stack<K, V, Policy>::push(const K& key, V&& value) {
+        push_and_wake([&](stack<K, V, Policy>& s) { s.push(key, std::move(value)); });
+    }
+
+    template <class K, class V, class Policy>
+    template <class InputIt>
+    void async_stack<K, V, Policy>::push_range(InputIt first, InputIt last) {
+        push_and_wake([&](stack<K, V, Policy>& s) { s.push_range(first, last); });
+    }
+
+    template <class K, class V, class Policy>
+    async_stack<K, V, Policy>::pop_awaiter async_stack<K, V, Policy>::async_pop() {
+        return pop_awaiter(*this);
+    }
+
+    template <class K, class V, class Policy>
+    async_stack<K, V, Policy>::key_pop_awaiter async_stack<K, V, Policy>::async_pop(const K& key) {
+        return key_pop_awaiter(*this, key);
+    }
+
+    template <class K, class V, class Policy>
+    std::optional<std::pair<K, V>> async_stack<K, V, Policy>::try_pop() {
+        result_t result;
+        std::lock_guard<std::mutex> guard(lock);
+        take(std::nullopt, result);
+        return result;
+    }
+
+    template <class K, class V, class Policy>
+    std::optional<V> async_stack<K, V, Policy>::try_pop(const K& key) {
+        result_t result;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!take(key, result)) return std::nullopt;
+        }
+        return std::move(result->second);
+    }
+
+    template <class K, class V, class Policy>
+    size_t async_stack<K, V, Policy>::size() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return elements.size();
+    }
+
+    template <class K, class V, class Policy>
+    size_t async_stack<K, V, Policy>::count(const K& key) const {
+        std::lock_guard<std::mutex> guard(lock);
+        return elements.count(key);
+    }
+
+    template <class K, class V, class Policy>
+    size_t async_stack<K, V, Policy>::waiting() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return waiters;
+    }
+
+    template <class K, class V, class Policy>
+    bool async_stack<K, V, Policy>::take(const std::optional<K>& key, result_t& result) {
+        if (key) {
+            if (elements.count(*key) == 0) return false;
+            // Only the front element can be moved out (by extract).
+            result.emplace(*key, std::as_const(elements).front(*key));
+            elements.pop(*key);
+            return true;
+        }
+        if (elements.size() == 0) return false;
+        if constexpr (std::is_nothrow_move_constructible_v<K> && std::is_nothrow_move_constructible_v<V>) {
+            K front_key(std::as_const(elements).front().first);
+            result.emplace(std::move(front_key), elements.extract());
+        } else {
+            auto [front_key, value] = std::as_const(elements).front();
+            result.emplace(front_key, value);
+            elements.pop();
+        }
+        return true;
+    }
+
+    template <class K, class V, class Policy>
+    async_stack<K, V, Policy>::waiter_t* async_stack<K, V, Policy>::dispatch() noexcept {
+        waiter_t* ready = nullptr;
+        waiter_t** ready_end = &ready;
+        waiter_t* kept = nullptr;
+        waiter_t** link = &first;
+        // No one else can take anything from an empty stack.
+        while (*link != nullptr && elements.size() > 0) {
+            waiter_t* waiter = *link;
+            bool taken;
+            try {
+                taken = take(waiter->key, waiter->result);
+            } catch (...) {
+                waiter->error = std::current_exception();
+                taken = true;
+            }
+            if (!taken) {
+                kept = waiter;
+                link = &waiter->next;
+                continue;
+            }
+            *link = waiter->next;
+            --waiters;
+            waiter->next = nullptr;
+            *ready_end = waiter;
+            ready_end = &waiter->next;
+        }
+        // The unvisited consumers stay after the kept ones.
+        if (*link == nullptr) last = kept;
+        return ready;
+    }
+
+    template <class K, class V, class Policy>
+    template <class F>
+    void async_stack<K, V, Policy>::push_and_wake(F&& push) {
+        waiter_t* ready;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            push(elements);
+            ready = dispatch();
+        }
+        // Outside the lock, as the consumers may use the stack again.
+        while (ready != nullptr) {
+            // The awaiter ends with the co_await it is resumed into.
+            waiter_t* next = ready->next;
+            ready->handle.resume();
+            ready = next;
+        }
+    }
+
+    // -- waiter_t -- //
+
+    template <class K, class V, class Policy>
+    async_stack<K, V, Policy>::waiter_t::waiter_t(async_stack& owner, std::optional<K> key)
+            : owner(&owner)
+            , key(std::move(key))
+            , result()
+            , error()
+            , handle()
+            , next(nullptr) {}
+
+    template <class K, class V, class Policy>
+    bool async_stack<K, V, Policy>::waiter_t::await_ready() const noexcept {
+        // Checked under the lock, by await_suspend.
+        return false;
+    }
+
+    template <class K, class V, class Policy>
+    bool async_stack<K, V, Policy>::waiter_t::await_suspend(std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> guard(owner->lock);
+        if (owner->take(key, result)) return false;
+
+        this->handle = handle;
+        if (owner->last != nullptr) owner->last->next = this;
+        else owner->first = this;
+        owner->last = this;
+        ++owner->waiters;
+        return true;
+    }
+
+    // -- pop_awaiter -- //
+
+    template <class K, class V, class Policy>
+    async_stack<K, V, Policy>::pop_awaiter::pop_awaiter(async_stack& owner)
+            : waiter_t(owner, std::nullopt) {}
+
+    template <class K, class V, class Policy>
+    std::pair<K, V> async_stack<K, V, Policy>::pop_awaiter::await_resume() {
+        if (this->error) std::rethrow_exception(this->error);
+        return std::move(*this->result);
+    }
+
+    // -- key_pop_awaiter -- //
+
+    template <class K, class V, class Policy>
+    async_stack<K, V, Policy>::key_pop_awaiter::key_pop_awaiter(async_stack& owner, const K& key)
+            : waiter_t(owner, key) {}
+
+    template <class K, class V, class Policy>
+    V async_stack<K, V, Policy>::key_pop_awaiter::await_resume() {
+        if (this->error) std::rethrow_exception(this->error);
+        return std::move(this->result->second);
+    }
+}
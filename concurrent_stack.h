@@ -0,0 +1,328 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "persistent_stack.h"
+
+namespace cxx {
+
+    // Hazard pointers: a reader announces the pointer it reads in a
+    // record of its own, and whoever retires a pointer only destroys
+    // its object once no record holds it. Reading takes no lock and
+    // writes to no shared memory, apart from the record.
+    //
+    // Each thread takes a record on its first read and gives it back
+    // when it exits. Records are padded to a cache line, so readers on
+    // different threads don't contend, and never freed.
+    class hazard_pointers {
+    private:
+        struct record_t;
+
+    public:
+        // Keeps the pointer it protects from being reclaimed for as
+        // long as it lives. Guards may be nested.
+        class guard {
+        public:
+            // Throws std::bad_alloc if a record can't be allocated.
+            guard();
+            guard(const guard&) = delete;
+            guard& operator=(const guard&) = delete;
+            ~guard();
+
+            // Loads the pointer, and protects it from then on.
+            template <class T>
+            const T* protect(const std::atomic<const T*>&) noexcept;
+
+        private:
+            record_t* record;
+        };
+
+        // Whether some guard protects the pointer. Must only be called
+        // once the pointer can't be loaded anymore.
+        static bool is_protected(const void*) noexcept;
+
+    private:
+        struct alignas(64) record_t {
+            std::atomic<const void*> pointer{nullptr};
+            std::atomic<bool> taken{true};
+            record_t* next = nullptr;
+        };
+        // The record of the current thread.
+        struct local_t {
+            record_t* record = nullptr;
+            // Whether a guard uses the record (nested ones don't).
+            bool busy = false;
+            ~local_t();
+        };
+
+        static inline std::atomic<record_t*> records{nullptr};
+        static thread_local local_t local;
+
+        // Takes a free record, or allocates a new one.
+        static record_t* acquire();
+        static void release(record_t*) noexcept;
+    };
+
+    // A stack with the semantics of cxx::stack, which can be used
+    // from many threads at once. Writers are serialized by a mutex,
+    // and each one publishes a new immutable snapshot of the stack.
+    // Readers never take a lock: they protect the current snapshot
+    // with a hazard pointer and read it in place, while writers keep
+    // publishing new ones. A replaced snapshot is destroyed by the
+    // first writer that finds no reader protecting it.
+    //
+    // Snapshots are persistent_stacks, so a writer copies the
+    // current one in O(1) time and modifies its copy in O(log n)
+    // time, no matter how many readers still hold old snapshots.
+    //
+    // Since a snapshot may be replaced at any time, the front methods
+    // return copies. A snapshot() can be held to read several
+    // elements (or iterate over the keys) consistently; unlike the
+    // other reads, taking one updates a shared reference count.
+    //
+    // A thread's first read allocates its hazard record, so every
+    // read may throw std::bad_alloc.
+    template <class K, class V>
+    class concurrent_stack {
+    public:
+        using snapshot_t = std::shared_ptr<const persistent_stack<K, V>>;
+
+        concurrent_stack();
+        // Starts from the given snapshot, which must not be null.
+        explicit concurrent_stack(snapshot_t);
+        concurrent_stack(const concurrent_stack&) = delete;
+        concurrent_stack& operator=(const concurrent_stack&) = delete;
+
+        void push(const K&, const V&);
+        void push(const K&, V&&);
+        // Constructs the value in place from the given arguments.
+        template <class... Args>
+        void emplace(const K&, Args&&...);
+        void pop();
+        void pop(const K&);
+        // Call f(const K&, V&) on a copy of the front value, which
+        // replaces the value only if f returns normally. Writers wait
+        // for f, so it should be short.
+        template <class F>
+        void update_front(F&&);
+        template <class F>
+        void update_front(const K&, F&&);
+
+        std::pair<K, V> front() const;
+        V front(const K&) const;
+
+        size_t size() const;
+        size_t count(const K&) const;
+
+        void clear();
+
+        // The current state, which stays valid (and unchanged)
+        // for as long as it is held.
+        snapshot_t snapshot() const;
+
+    private:
+        using stack_t = persistent_stack<K, V>;
+
+        // Serializes the writers.
+        std::mutex writer;
+        // Owns the current snapshot, which only writers replace.
+        std::unique_ptr<const snapshot_t> published;
+        // The published snapshot, which readers protect.
+        std::atomic<const snapshot_t*> current;
+        // The replaced snapshots which readers may still protect.
+        std::vector<std::unique_ptr<const snapshot_t>> retired;
+
+        // Applies f to a copy of the current state and publishes it.
+        // If f throws, nothing is published.
+        template <class F>
+        void modify(F&&);
+        // Publishes the snapshot, and destroys the replaced ones
+        // no reader protects. The writer must be locked.
+        void publish(stack_t&&);
+    };
+
+    // ---------- Implementations ---------- //
+
+    // -- hazard_pointers -- //
+
+    inline thread_local hazard_pointers::local_t hazard_pointers::local;
+
+    inline hazard_pointers::guard::guard() : record(nullptr) {
+        // Nested guards take records of their own.
+        if (local.busy) {
+            record = acquire();
+            return;
+        }
+        if (local.record == nullptr) local.record = acquire();
+        record = local.record;
+        local.busy = true;
+    }
+
+    inline hazard_pointers::guard::~guard() {
+        record->pointer.store(nullptr, std::memory_order_release);
+        if (record == local.record) local.busy = false;
+        else release(record);
+    }
+
+    template <class T>
+    const T* hazard_pointers::guard::protect(const std::atomic<const T*>& source) noexcept {
+        const T* pointer = source.load(std::memory_order_relaxed);
+        // The pointer is only protected if it was still published after
+        // it was announced, as every later retirement then sees it.
+        while (true) {
+            record->pointer.store(pointer, std::memory_order_seq_cst);
+            const T* again = source.load(std::memory_order_seq_cst);
+            if (again == pointer) return pointer;
+            pointer = again;
+        }
+    }
+
+    inline bool hazard_pointers::is_protected(const void* pointer) noexcept {
+        for (record_t* r = records.load(std::memory_order_acquire); r != nullptr; r = r->next)
+            if (r->pointer.load(std::memory_order_seq_cst) == pointer) return true;
+        return false;
+    }
+
+    inline hazard_pointers::local_t::~local_t() {
+        if (record != nullptr) release(record);
+    }
+
+    inline hazard_pointers::record_t* hazard_pointers::acquire() {
+        for (record_t* r = records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+            if (!r->taken.load(std::memory_order_relaxed)
+                    && !r->taken.exchange(true, std::memory_order_acquire))
+                return r;
+        }
+        // Records are only ever added at the head.
+        record_t* r = new record_t;
+        r->next = records.load(std::memory_order_relaxed);
+        while (!records.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                              std::memory_order_relaxed)) {}
+        return r;
+    }
+
+    inline void hazard_pointers::release(record_t* r) noexcept {
+        r->taken.store(false, std::memory_order_release);
+    }
+
+    // -- concurrent_stack -- //
+
+    template <class K, class V>
+    concurrent_stack<K, V>::concurrent_stack()
+            : concurrent_stack(std::make_shared<const stack_t>()) {}
+
+    template <class K, class V>
+    concurrent_stack<K, V>::concurrent_stack(snapshot_t snapshot)
+            : writer()
+            , published(std::make_unique<const snapshot_t>(std::move(snapshot)))
+            , current(published.get())
+            , retired() {}
+
+    template <class K, class V>
+    void concurrent_stack<K, V>::push(const K& key, const V& value) {
+        modify([&](stack_t& s) { s.push(key, value); });
+    }
+
+    template <class K, class V>
+    void concurrent_stack<K, V>::push(const K& key, V&& value) {
+        // Only a successful push consumes the value.
+        modify([&](stack_t& s) { s.push(key, std::move(value)); });
+    }
+
+    template <class K, class V>
+    template <class... Args>
+    void concurrent_stack<K, V>::emplace(const K& key, Args&&... args) {
+        modify([&](stack_t& s) { s.emplace(key, std::forward<Args>(args)...); });
+    }
+
+    template <class K, class V>
+    void concurrent_stack<K, V>::pop() {
+        modify([](stack_t& s) { s.pop(); });
+    }
+
+    template <class K, class V>
+    void concurrent_stack<K, V>::pop(const K& key) {
+        modify([&](stack_t& s) { s.pop(key); });
+    }
+
+    template <class K, class V>
+    template <class F>
+    void concurrent_stack<K, V>::update_front(F&& f) {
+        modify([&](stack_t& s) { s.update_front(std::forward<F>(f)); });
+    }
+
+    template <class K, class V>
+    template <class F>
+    void concurrent_stack<K, V>::update_front(const K& key, F&& f) {
+        modify([&](stack_t& s) { s.update_front(key, std::forward<F>(f)); });
+    }
+
+    template <class K, class V>
+    std::pair<K, V> concurrent_stack<K, V>::front() const {
+        // The guard keeps the element alive while it is copied.
+        hazard_pointers::guard guard;
+        auto [key, value] = (*guard.protect(current))->front();
+        return {key, value};
+    }
+
+    template <class K, class V>
+    V concurrent_stack<K, V>::front(const K& key) const {
+        hazard_pointers::guard guard;
+        return (*guard.protect(current))->front(key);
+    }
+
+    template <class K, class V>
+    size_t concurrent_stack<K, V>::size() const {
+        hazard_pointers::guard guard;
+        return (*guard.protect(current))->size();
+    }
+
+    template <class K, class V>
+    size_t concurrent_stack<K, V>::count(const K& key) const {
+        hazard_pointers::guard guard;
+        return (*guard.protect(current))->count(key);
+    }
+
+    template <class K, class V>
+    void concurrent_stack<K, V>::clear() {
+        std::lock_guard<std::mutex> lock(writer);
+        publish(stack_t());
+    }
+
+    template <class K, class V>
+    concurrent_stack<K, V>::snapshot_t concurrent_stack<K, V>::snapshot() const {
+        hazard_pointers::guard guard;
+        return *guard.protect(current);
+    }
+
+    template <class K, class V>
+    template <class F>
+    void concurrent_stack<K, V>::modify(F&& f) {
+        std::lock_guard<std::mutex> lock(writer);
+        // Only writers publish, so the snapshot can't change under us.
+        stack_t next(**published);
+        f(next);
+        publish(std::move(next));
+    }
+
+    template <class K, class V>
+    void concurrent_stack<K, V>::publish(stack_t&& next) {
+        // Allocate everything first, so that a failure publishes nothing.
+        auto snapshot = std::make_unique<const snapshot_t>(
+                std::make_shared<const stack_t>(std::move(next)));
+        retired.reserve(retired.size() + 1);
+
+        current.store(snapshot.get(), std::memory_order_seq_cst);
+        retired.push_back(std::move(published));
+        published = std::move(snapshot);
+        // Only the readers that loaded a replaced snapshot before it
+        // was replaced can protect it, so there are at most as many
+        // left as there are readers.
+        std::erase_if(retired, [](const auto& old) {
+            return !hazard_pointers::is_protected(old.get());
+        });
+    }
+}
@@ -0,0 +1,278 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include "stack.h"
+
+namespace cxx {
+
+    // A stack loaded from an image file written by stack::serialize,
+    // which is mapped into memory (with POSIX mmap), so that opening
+    // it takes O(1) time no matter how big the stack is. Until the
+    // first modification, the front methods, count and key iteration
+    // read the mapped image in place; the keyed ones binary search its
+    // key table with operator<. The first modification (or a call to
+    // get()) loads the image into a cxx::stack, which then serves every
+    // operation, and unmaps the file.
+    template <class K, class V, class Policy = stack_policy>
+    class mapped_stack {
+        using image_t = stack_image<K, V>;
+    public:
+        using stack_t = stack<K, V, Policy>;
+        class const_iterator;
+
+        // Throws std::system_error if the file can't be mapped, and
+        // std::invalid_argument if it doesn't hold a valid image.
+        explicit mapped_stack(const std::string& path);
+        mapped_stack(const mapped_stack&) = delete;
+        mapped_stack& operator=(const mapped_stack&) = delete;
+        ~mapped_stack();
+
+        void push(const K&, const V&);
+        void pop();
+        void pop(const K&);
+
+        std::pair<const K&, const V&> front() const;
+        const V& front(const K&) const;
+
+        size_t size() const noexcept;
+        size_t count(const K&) const;
+
+        // Only throw if the loaded stack's do.
+        const_iterator cbegin() const noexcept(noexcept(std::declval<const stack_t&>().cbegin()));
+        const_iterator cend() const noexcept(noexcept(std::declval<const stack_t&>().cend()));
+
+        // Whether the operations still read the mapped image.
+        bool is_mapped() const noexcept;
+        // The stack, loaded from the image if it hasn't been yet.
+        stack_t& get();
+
+    private:
+        void* mapping;
+        size_t mapping_size;
+        // Engaged while the file is mapped.
+        std::optional<image_t> image;
+        std::optional<stack_t> loaded;
+
+        void unmap() noexcept;
+        // The element at the given position of the image, checked.
+        const image_t::element_t& element(size_t) const;
+    };
+
+    // Iterates over the keys in increasing order, either in the
+    // image or in the loaded stack.
+    template <class K, class V, class Policy>
+    class mapped_stack<K, V, Policy>::const_iterator {
+        using stack_iterator_t = typename stack_t::const_iterator;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = K;
+        using difference_type = std::ptrdiff_t;
+
+        const_iterator() = default;
+
+        const_iterator& operator++() noexcept;
+        const_iterator operator++(int) noexcept;
+
+        const K& operator*() const;
+        const K* operator->() const;
+
+        bool operator==(const const_iterator&) const noexcept;
+
+    private:
+        friend class mapped_stack;
+
+        // Null once the stack has been loaded.
+        const image_t::key_t* record = nullptr;
+        stack_iterator_t it;
+
+        const_iterator(const image_t::key_t*, stack_iterator_t) noexcept;
+    };
+
+    // ---------- Implementations ---------- //
+
+    template <class K, class V, class Policy>
+    mapped_stack<K, V, Policy>::mapped_stack(const std::string& path)
+            : mapping(nullptr)
+            , mapping_size(0)
+            , image()
+            , loaded() {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "Tried to open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "Tried to stat " + path);
+        }
+        mapping_size = static_cast<size_t>(st.st_size);
+        // An empty file isn't an image, and can't be mapped either.
+        if (mapping_size > 0)
+            mapping = ::mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int error = errno;
+        // The mapping outlives the descriptor.
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            mapping = nullptr;
+            throw std::system_error(error, std::generic_category(), "Tried to map " + path);
+        }
+
+        try {
+            image.emplace(std::span(static_cast<const std::byte*>(mapping), mapping_size));
+        } catch (...) {
+            unmap();
+            throw;
+        }
+    }
+
+    template <class K, class V, class Policy>
+    mapped_stack<K, V, Policy>::~mapped_stack() {
+        unmap();
+    }
+
+    template <class K, class V, class Policy>
+    void mapped_stack<K, V, Policy>::push(const K& key, const V& value) {
+        get().push(key, value);
+    }
+
+    template <class K, class V, class Policy>
+    void mapped_stack<K, V, Policy>::pop() {
+        get().pop();
+    }
+
+    template <class K, class V, class Policy>
+    void mapped_stack<K, V, Policy>::pop(const K& key) {
+        get().pop(key);
+    }
+
+    template <class K, class V, class Policy>
+    std::pair<const K&, const V&> mapped_stack<K, V, Policy>::front() const {
+        if (loaded) return std::as_const(*loaded).front();
+
+        if (image->elements().empty())
+            throw std::invalid_argument("Tried to use front() on empty stack.");
+        const auto& el = element(image->elements().size() - 1);
+        if (el.key >= image->keys().size()) image_t::malformed();
+        return {image->keys()[el.key].key, el.value};
+    }
+
+    template <class K, class V, class Policy>
+    const V& mapped_stack<K, V, Policy>::front(const K& key) const {
+        if (loaded) return std::as_const(*loaded).front(key);
+
+        if (image->elements().empty())
+            throw std::invalid_argument("Tried to use front(const K& k) on empty stack.");
+        const auto* record = image->find(key);
+        if (record == nullptr)
+            throw std::invalid_argument("Tried to use front(const K& k) on stack with no key k.");
+        return element(record->top).value;
+    }
+
+    template <class K, class V, class Policy>
+    size_t mapped_stack<K, V, Policy>::size() const noexcept {
+        return loaded ? loaded->size() : image->elements().size();
+    }
+
+    template <class K, class V, class Policy>
+    size_t mapped_stack<K, V, Policy>::count(const K& key) const {
+        if (loaded) return loaded->count(key);
+
+        const auto* record = image->find(key);
+        return record == nullptr ? 0 : record->count;
+    }
+
+    template <class K, class V, class Policy>
+    mapped_stack<K, V, Policy>::const_iterator mapped_stack<K, V, Policy>::cbegin() const
+            noexcept(noexcept(std::declval<const stack_t&>().cbegin())) {
+        if (loaded) return const_iterator(nullptr, loaded->cbegin());
+        return const_iterator(image->keys().data(), {});
+    }
+
+    template <class K, class V, class Policy>
+    mapped_stack<K, V, Policy>::const_iterator mapped_stack<K, V, Policy>::cend() const
+            noexcept(noexcept(std::declval<const stack_t&>().cend())) {
+        if (loaded) return const_iterator(nullptr, loaded->cend());
+        return const_iterator(image->keys().data() + image->keys().size(), {});
+    }
+
+    template <class K, class V, class Policy>
+    bool mapped_stack<K, V, Policy>::is_mapped() const noexcept {
+        return !loaded;
+    }
+
+    template <class K, class V, class Policy>
+    mapped_stack<K, V, Policy>::stack_t& mapped_stack<K, V, Policy>::get() {
+        if (!loaded) {
+            // If loading throws, the image is still mapped.
+            loaded.emplace(stack_t::deserialize(
+                    std::span(static_cast<const std::byte*>(mapping), mapping_size)));
+            unmap();
+        }
+        return *loaded;
+    }
+
+    template <class K, class V, class Policy>
+    void mapped_stack<K, V, Policy>::unmap() noexcept {
+        image.reset();
+        if (mapping != nullptr) ::munmap(mapping, mapping_size);
+        mapping = nullptr;
+    }
+
+    template <class K, class V, class Policy>
+    const typename mapped_stack<K, V, Policy>::image_t::element_t&
+    mapped_stack<K, V, Policy>::element(size_t pos) const {
+        // The records aren't checked when the file is mapped.
+        if (pos >= image->elements().size()) image_t::malformed();
+        return image->elements()[pos];
+    }
+
+    // -- const_iterator -- //
+
+    template <class K, class V, class Policy>
+    mapped_stack<K, V, Policy>::const_iterator::const_iterator(
+            const image_t::key_t* record, stack_iterator_t it) noexcept
+            : record(record)
+            , it(it) {}
+
+    template <class K, class V, class Policy>
+    mapped_stack<K, V, Policy>::const_iterator&
+    mapped_stack<K, V, Policy>::const_iterator::operator++() noexcept {
+        if (record != nullptr) ++record;
+        else ++it;
+        return *this;
+    }
+
+    template <class K, class V, class Policy>
+    mapped_stack<K, V, Policy>::const_iterator
+    mapped_stack<K, V, Policy>::const_iterator::operator++(int) noexcept {
+        const_iterator tmp(*this);
+        operator++();
+        return tmp;
+    }
+
+    template <class K, class V, class Policy>
+    const K& mapped_stack<K, V, Policy>::const_iterator::operator*() const {
+        return record != nullptr ? record->key : *it;
+    }
+
+    template <class K, class V, class Policy>
+    const K* mapped_stack<K, V, Policy>::const_iterator::operator->() const {
+        return &operator*();
+    }
+
+    template <class K, class V, class Policy>
+    bool mapped_stack<K, V, Policy>::const_iterator::operator==(const const_iterator& iter) const noexcept {
+        return record == iter.record && it == iter.it;
+    }
+}
@@ -0,0 +1,634 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace cxx {
+
+    // A stack with the semantics of cxx::stack, whose copies share
+    // their structure instead of being copied on write. Copying takes
+    // O(1) time and every modification of a copy takes O(log n) time,
+    // no matter how many other copies share its nodes.
+    //
+    // Nodes are immutable once shared, so only const references to the
+    // values are handed out, and values are modified via update_front.
+    template <class K, class V>
+    class persistent_stack {
+    public:
+        persistent_stack() noexcept;
+        persistent_stack(const persistent_stack&) noexcept;
+        persistent_stack(persistent_stack&&) noexcept;
+
+        persistent_stack& operator=(persistent_stack) noexcept;
+
+        void push(const K&, const V&);
+        void push(const K&, V&&);
+        // Constructs the value in place from the given arguments.
+        template <class... Args>
+        void emplace(const K&, Args&&...);
+        void pop();
+        void pop(const K&);
+
+        std::pair<const K&, const V&> front() const;
+        const V& front(const K&) const;
+        // Call f(const K&, V&) on a private copy of the front value,
+        // which replaces the value only if f returns normally.
+        // Time complexity O(log n) plus the copy of the value.
+        template <class F>
+        decltype(auto) update_front(F&&);
+        template <class F>
+        decltype(auto) update_front(const K&, F&&);
+
+        size_t size() const noexcept;
+        size_t count(const K&) const;
+
+        void clear() noexcept;
+
+        class const_iterator;
+        const_iterator cbegin() const noexcept;
+        const_iterator cend() const noexcept;
+
+    private:
+        // An immutable AVL tree. Every modification copies the path
+        // to the modified node and shares the rest with the old tree.
+        template <class Key, class T, class Less>
+        class tree;
+
+        // The values of a key form an immutable linked list,
+        // the topmost value first.
+        struct value_node;
+        using value_ptr = std::shared_ptr<const value_node>;
+        // Keys are shared by all the copies of their tree nodes.
+        using key_ptr = std::shared_ptr<const K>;
+        struct key_less;
+        struct key_entry {
+            value_ptr head;
+            size_t count;
+        };
+        using key_tree = tree<key_ptr, key_entry, key_less>;
+        // Maps push sequence numbers to keys, in stack order.
+        using order_tree = tree<uint64_t, key_ptr, std::less<>>;
+        using key_node_ptr = std::shared_ptr<const typename key_tree::node>;
+        using order_node_ptr = std::shared_ptr<const typename order_tree::node>;
+        using top_t = std::pair<const K*, const V*>;
+
+        key_node_ptr keys;
+        order_node_ptr order;
+        size_t elements;
+        uint64_t next_seq;
+        // Cached, so that front() takes constant time.
+        top_t top;
+
+        void swap(persistent_stack&, persistent_stack&) noexcept;
+
+        template <class... Args>
+        void emplace_value(const K&, Args&&...);
+        void remove_top_of(const typename key_tree::node*);
+        template <class F>
+        decltype(auto) update_value(const typename key_tree::node*, F&&);
+        static top_t top_of(const order_node_ptr&, const key_node_ptr&);
+    };
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    class persistent_stack<K, V>::tree {
+    public:
+        struct node;
+        using node_ptr = std::shared_ptr<const node>;
+        struct node {
+            Key key;
+            T value;
+            node_ptr left;
+            node_ptr right;
+            int height;
+            node(const Key&, const T&, node_ptr, node_ptr) noexcept;
+        };
+
+        // Inserts the key or replaces its value.
+        static node_ptr assign(const node_ptr&, const Key&, const T&);
+        // The key must be present.
+        template <class Q>
+        static node_ptr erase(const node_ptr&, const Q&);
+        template <class Q>
+        static const node* find(const node_ptr&, const Q&);
+        static const node* min(const node_ptr&) noexcept;
+        static const node* max(const node_ptr&) noexcept;
+
+    private:
+        static int height(const node_ptr&) noexcept;
+        static node_ptr make(const Key&, const T&, node_ptr, node_ptr);
+        static node_ptr balance(const Key&, const T&, node_ptr, node_ptr);
+        static node_ptr erase_min(const node_ptr&);
+    };
+
+    template <class K, class V>
+    struct persistent_stack<K, V>::value_node {
+        V value;
+        uint64_t seq;
+        value_ptr next;
+        template <class... Args>
+        value_node(uint64_t, value_ptr, Args&&...);
+        // Unlinks the list iteratively, since it may be very long.
+        // Every node must be created non-const, as this moves the
+        // links out of the nodes it owns.
+        ~value_node();
+    };
+
+    template <class K, class V>
+    struct persistent_stack<K, V>::key_less {
+        using is_transparent = void;
+        bool operator()(const key_ptr&, const key_ptr&) const;
+        bool operator()(const key_ptr&, const K&) const;
+        bool operator()(const K&, const key_ptr&) const;
+    };
+
+    // Walks the key tree in order, keeping the path on a fixed-size
+    // stack, so that the iterator never allocates.
+    template <class K, class V>
+    class persistent_stack<K, V>::const_iterator {
+        using node_t = typename key_tree::node;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = K;
+        using difference_type = std::ptrdiff_t;
+
+        const_iterator() noexcept;
+        const_iterator(const const_iterator&) noexcept = default;
+
+        const_iterator& operator=(const const_iterator&) noexcept = default;
+
+        const_iterator& operator++() noexcept;
+        const_iterator operator++(int) noexcept;
+
+        const K& operator*() const;
+        const K* operator->() const;
+
+        bool operator==(const const_iterator&) const noexcept;
+        bool operator!=(const const_iterator&) const noexcept;
+
+    private:
+        // An AVL tree of this height has over 10^19 nodes.
+        static constexpr size_t max_height = 96;
+        std::array<const node_t*, max_height> path;
+        size_t depth;
+
+        explicit const_iterator(const node_t*) noexcept;
+        void descend(const node_t*) noexcept;
+
+        friend const_iterator persistent_stack::cbegin() const noexcept;
+    };
+
+
+    // ---------- Implementations ---------- //
+    // -- persistent_stack -- //
+
+    template <class K, class V>
+    persistent_stack<K, V>::persistent_stack() noexcept
+            : keys(nullptr)
+            , order(nullptr)
+            , elements(0)
+            , next_seq(0)
+            , top(nullptr, nullptr) {}
+
+    template <class K, class V>
+    persistent_stack<K, V>::persistent_stack(const persistent_stack& other) noexcept
+            : keys(other.keys)
+            , order(other.order)
+            , elements(other.elements)
+            , next_seq(other.next_seq)
+            , top(other.top) {}
+
+    template <class K, class V>
+    persistent_stack<K, V>::persistent_stack(persistent_stack&& other) noexcept
+            : keys(std::move(other.keys))
+            , order(std::move(other.order))
+            , elements(other.elements)
+            , next_seq(other.next_seq)
+            , top(other.top) {
+        other.elements = 0;
+        other.top = top_t(nullptr, nullptr);
+    }
+
+    template <class K, class V>
+    persistent_stack<K, V>& persistent_stack<K, V>::operator=(persistent_stack other) noexcept {
+        swap(*this, other);
+        return *this;
+    }
+
+    template <class K, class V>
+    void persistent_stack<K, V>::push(const K& key, const V& value) {
+        emplace_value(key, value);
+    }
+
+    template <class K, class V>
+    void persistent_stack<K, V>::push(const K& key, V&& value) {
+        emplace_value(key, std::move(value));
+    }
+
+    template <class K, class V>
+    template <class... Args>
+    void persistent_stack<K, V>::emplace(const K& key, Args&&... args) {
+        emplace_value(key, std::forward<Args>(args)...);
+    }
+
+    template <class K, class V>
+    void persistent_stack<K, V>::pop() {
+        if (size() == 0)
+            throw std::invalid_argument("Tried to use pop() on empty stack.");
+
+        remove_top_of(key_tree::find(keys, *top.first));
+    }
+
+    template <class K, class V>
+    void persistent_stack<K, V>::pop(const K& k) {
+        if (size() == 0)
+            throw std::invalid_argument("Tried to use pop(const K& k) on empty stack.");
+
+        auto last_with_key = key_tree::find(keys, k);
+        if (last_with_key == nullptr)
+            throw std::invalid_argument("Tried to use pop(const K& k) on stack with no key k.");
+
+        remove_top_of(last_with_key);
+    }
+
+    template <class K, class V>
+    std::pair<const K&, const V&> persistent_stack<K, V>::front() const {
+        if (size() == 0)
+            throw std::invalid_argument("Tried to use front() on empty stack.");
+
+        return {*top.first, *top.second};
+    }
+
+    template <class K, class V>
+    const V& persistent_stack<K, V>::front(const K& k) const {
+        if (size() == 0)
+            throw std::invalid_argument("Tried to use front(const K& k) on empty stack.");
+
+        auto last_with_key = key_tree::find(keys, k);
+        if (last_with_key == nullptr)
+            throw std::invalid_argument("Tried to use front(const K& k) on stack with no key k.");
+
+        return last_with_key->value.head->value;
+    }
+
+    template <class K, class V>
+    template <class F>
+    decltype(auto) persistent_stack<K, V>::update_front(F&& f) {
+        if (size() == 0)
+            throw std::invalid_argument("Tried to use update_front() on empty stack.");
+
+        return update_value(key_tree::find(keys, *top.first), std::forward<F>(f));
+    }
+
+    template <class K, class V>
+    template <class F>
+    decltype(auto) persistent_stack<K, V>::update_front(const K& k, F&& f) {
+        if (size() == 0)
+            throw std::invalid_argument("Tried to use update_front(const K& k) on empty stack.");
+
+        auto last_with_key = key_tree::find(keys, k);
+        if (last_with_key == nullptr)
+            throw std::invalid_argument("Tried to use update_front(const K& k) on stack with no key k.");
+
+        return update_value(last_with_key, std::forward<F>(f));
+    }
+
+    template <class K, class V>
+    size_t persistent_stack<K, V>::size() const noexcept {
+        return elements;
+    }
+
+    template <class K, class V>
+    size_t persistent_stack<K, V>::count(const K& key) const {
+        auto entry = key_tree::find(keys, key);
+        return entry == nullptr ? 0 : entry->value.count;
+    }
+
+    template <class K, class V>
+    void persistent_stack<K, V>::clear() noexcept {
+        keys = nullptr;
+        order = nullptr;
+        elements = 0;
+        top = top_t(nullptr, nullptr);
+    }
+
+    template <class K, class V>
+    persistent_stack<K, V>::const_iterator persistent_stack<K, V>::cbegin() const noexcept {
+        return const_iterator(keys.get());
+    }
+
+    template <class K, class V>
+    persistent_stack<K, V>::const_iterator persistent_stack<K, V>::cend() const noexcept {
+        return const_iterator();
+    }
+
+    template <class K, class V>
+    void persistent_stack<K, V>::swap(persistent_stack& a, persistent_stack& b) noexcept {
+        std::swap(a.keys, b.keys);
+        std::swap(a.order, b.order);
+        std::swap(a.elements, b.elements);
+        std::swap(a.next_seq, b.next_seq);
+        std::swap(a.top, b.top);
+    }
+
+    template <class K, class V>
+    template <class... Args>
+    void persistent_stack<K, V>::emplace_value(const K& key, Args&&... args) {
+        // Build the new version on the side. Nothing that
+        // the other copies can see is ever modified.
+        auto entry = key_tree::find(keys, key);
+        key_ptr shared_key = entry != nullptr ? entry->key : std::make_shared<const K>(key);
+        value_ptr below = entry != nullptr ? entry->value.head : nullptr;
+        size_t count = entry != nullptr ? entry->value.count : 0;
+        // Created non-const, so that ~value_node may unlink it.
+        auto head = std::make_shared<value_node>(next_seq, below, std::forward<Args>(args)...);
+        auto new_keys = key_tree::assign(keys, shared_key, key_entry{head, count + 1});
+        auto new_order = order_tree::assign(order, next_seq, shared_key);
+
+        // Publish it (nothrow).
+        keys = std::move(new_keys);
+        order = std::move(new_order);
+        ++elements;
+        ++next_seq;
+        top = top_t(shared_key.get(), &head->value);
+    }
+
+    template <class K, class V>
+    void persistent_stack<K, V>::remove_top_of(const typename key_tree::node* entry) {
+        const key_entry& data = entry->value;
+        auto new_order = order_tree::erase(order, data.head->seq);
+        auto new_keys = data.count == 1
+                ? key_tree::erase(keys, entry->key)
+                : key_tree::assign(keys, entry->key, key_entry{data.head->next, data.count - 1});
+        top_t new_top = top_of(new_order, new_keys);
+
+        // Publish the new version (nothrow).
+        keys = std::move(new_keys);
+        order = std::move(new_order);
+        --elements;
+        top = new_top;
+    }
+
+    template <class K, class V>
+    template <class F>
+    decltype(auto) persistent_stack<K, V>::update_value(const typename key_tree::node* entry, F&& f) {
+        const key_entry& data = entry->value;
+        const value_node& old_head = *data.head;
+        auto head = std::make_shared<value_node>(old_head.seq, old_head.next, old_head.value);
+        auto new_keys = key_tree::assign(keys, entry->key, key_entry{head, data.count});
+        auto publish = [&]() noexcept {
+            if (top.second == &old_head.value) top.second = &head->value;
+            keys = std::move(new_keys);
+        };
+
+        // Should f throw, the copy is simply dropped.
+        using result_t = std::invoke_result_t<F, const K&, V&>;
+        if constexpr (std::is_void_v<result_t>) {
+            std::invoke(std::forward<F>(f), *entry->key, head->value);
+            publish();
+        } else {
+            result_t res = std::invoke(std::forward<F>(f), *entry->key, head->value);
+            publish();
+            return res;
+        }
+    }
+
+    template <class K, class V>
+    persistent_stack<K, V>::top_t
+    persistent_stack<K, V>::top_of(const order_node_ptr& order, const key_node_ptr& keys) {
+        auto last = order_tree::max(order);
+        if (last == nullptr) return top_t(nullptr, nullptr);
+        auto entry = key_tree::find(keys, last->value);
+        return top_t(entry->key.get(), &entry->value.head->value);
+    }
+
+    // -- tree -- //
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    persistent_stack<K, V>::tree<Key, T, Less>::node::node(
+            const Key& key, const T& value, node_ptr left, node_ptr right) noexcept
+            : key(key)
+            , value(value)
+            , left(std::move(left))
+            , right(std::move(right))
+            , height(1 + std::max(tree::height(this->left), tree::height(this->right))) {}
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    persistent_stack<K, V>::tree<Key, T, Less>::node_ptr
+    persistent_stack<K, V>::tree<Key, T, Less>::assign(const node_ptr& root, const Key& key, const T& value) {
+        Less less;
+        if (root == nullptr)
+            return make(key, value, nullptr, nullptr);
+        if (less(key, root->key))
+            return balance(root->key, root->value, assign(root->left, key, value), root->right);
+        if (less(root->key, key))
+            return balance(root->key, root->value, root->left, assign(root->right, key, value));
+        return make(root->key, value, root->left, root->right);
+    }
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    template <class Q>
+    persistent_stack<K, V>::tree<Key, T, Less>::node_ptr
+    persistent_stack<K, V>::tree<Key, T, Less>::erase(const node_ptr& root, const Q& key) {
+        Less less;
+        if (less(key, root->key))
+            return balance(root->key, root->value, erase(root->left, key), root->right);
+        if (less(root->key, key))
+            return balance(root->key, root->value, root->left, erase(root->right, key));
+        if (root->left == nullptr) return root->right;
+        if (root->right == nullptr) return root->left;
+        // Replace the node with its successor.
+        const node* next = min(root->right);
+        return balance(next->key, next->value, root->left, erase_min(root->right));
+    }
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    template <class Q>
+    const typename persistent_stack<K, V>::template tree<Key, T, Less>::node*
+    persistent_stack<K, V>::tree<Key, T, Less>::find(const node_ptr& root, const Q& key) {
+        Less less;
+        const node* it = root.get();
+        while (it != nullptr) {
+            if (less(key, it->key)) it = it->left.get();
+            else if (less(it->key, key)) it = it->right.get();
+            else return it;
+        }
+        return nullptr;
+    }
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    const typename persistent_stack<K, V>::template tree<Key, T, Less>::node*
+    persistent_stack<K, V>::tree<Key, T, Less>::min(const node_ptr& root) noexcept {
+        const node* it = root.get();
+        while (it != nullptr && it->left != nullptr) it = it->left.get();
+        return it;
+    }
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    const typename persistent_stack<K, V>::template tree<Key, T, Less>::node*
+    persistent_stack<K, V>::tree<Key, T, Less>::max(const node_ptr& root) noexcept {
+        const node* it = root.get();
+        while (it != nullptr && it->right != nullptr) it = it->right.get();
+        return it;
+    }
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    int persistent_stack<K, V>::tree<Key, T, Less>::height(const node_ptr& root) noexcept {
+        return root == nullptr ? 0 : root->height;
+    }
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    persistent_stack<K, V>::tree<Key, T, Less>::node_ptr
+    persistent_stack<K, V>::tree<Key, T, Less>::make(
+            const Key& key, const T& value, node_ptr left, node_ptr right) {
+        return std::make_shared<const node>(key, value, std::move(left), std::move(right));
+    }
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    persistent_stack<K, V>::tree<Key, T, Less>::node_ptr
+    persistent_stack<K, V>::tree<Key, T, Less>::balance(
+            const Key& key, const T& value, node_ptr left, node_ptr right) {
+        int hl = height(left), hr = height(right);
+        if (hl > hr + 1) {
+            if (height(left->left) >= height(left->right)) {
+                // Single right rotation.
+                return make(left->key, left->value, left->left,
+                            make(key, value, left->right, std::move(right)));
+            }
+            // Left-right rotation.
+            const node& mid = *left->right;
+            return make(mid.key, mid.value,
+                        make(left->key, left->value, left->left, mid.left),
+                        make(key, value, mid.right, std::move(right)));
+        }
+        if (hr > hl + 1) {
+            if (height(right->right) >= height(right->left)) {
+                // Single left rotation.
+                return make(right->key, right->value,
+                            make(key, value, std::move(left), right->left), right->right);
+            }
+            // Right-left rotation.
+            const node& mid = *right->left;
+            return make(mid.key, mid.value,
+                        make(key, value, std::move(left), mid.left),
+                        make(right->key, right->value, mid.right, right->right));
+        }
+        return make(key, value, std::move(left), std::move(right));
+    }
+
+    template <class K, class V>
+    template <class Key, class T, class Less>
+    persistent_stack<K, V>::tree<Key, T, Less>::node_ptr
+    persistent_stack<K, V>::tree<Key, T, Less>::erase_min(const node_ptr& root) {
+        if (root->left == nullptr) return root->right;
+        return balance(root->key, root->value, erase_min(root->left), root->right);
+    }
+
+    // -- value_node -- //
+
+    template <class K, class V>
+    template <class... Args>
+    persistent_stack<K, V>::value_node::value_node(uint64_t seq, value_ptr next, Args&&... args)
+            : value(std::forward<Args>(args)...)
+            , seq(seq)
+            , next(std::move(next)) {}
+
+    template <class K, class V>
+    persistent_stack<K, V>::value_node::~value_node() {
+        value_ptr it = std::move(next);
+        // Only the sole owner of a node may unlink it.
+        while (it != nullptr && it.use_count() == 1)
+            it = std::move(const_cast<value_node&>(*it).next);
+    }
+
+    // -- key_less -- //
+
+    template <class K, class V>
+    bool persistent_stack<K, V>::key_less::operator()(const key_ptr& a, const key_ptr& b) const {
+        return *a < *b;
+    }
+
+    template <class K, class V>
+    bool persistent_stack<K, V>::key_less::operator()(const key_ptr& a, const K& b) const {
+        return *a < b;
+    }
+
+    template <class K, class V>
+    bool persistent_stack<K, V>::key_less::operator()(const K& a, const key_ptr& b) const {
+        return a < *b;
+    }
+
+    // -- const_iterator -- //
+
+    template <class K, class V>
+    persistent_stack<K, V>::const_iterator::const_iterator() noexcept
+            : path()
+            , depth(0) {}
+
+    template <class K, class V>
+    persistent_stack<K, V>::const_iterator::const_iterator(const node_t* root) noexcept
+            : path()
+            , depth(0) {
+        descend(root);
+    }
+
+    template <class K, class V>
+    persistent_stack<K, V>::const_iterator&
+    persistent_stack<K, V>::const_iterator::operator++() noexcept {
+        const node_t* current = path[--depth];
+        descend(current->right.get());
+        return *this;
+    }
+
+    template <class K, class V>
+    persistent_stack<K, V>::const_iterator
+    persistent_stack<K, V>::const_iterator::operator++(int) noexcept {
+        const_iterator tmp(*this);
+        operator++();
+        return tmp;
+    }
+
+    template <class K, class V>
+    const K& persistent_stack<K, V>::const_iterator::operator*() const {
+        return *path[depth - 1]->key;
+    }
+
+    template <class K, class V>
+    const K* persistent_stack<K, V>::const_iterator::operator->() const {
+        return path[depth - 1]->key.get();
+    }
+
+    template <class K, class V>
+    bool persistent_stack<K, V>::const_iterator::operator==(const const_iterator& iter) const noexcept {
+        if (depth == 0 || iter.depth == 0) return depth == iter.depth;
+        return path[depth - 1] == iter.path[iter.depth - 1];
+    }
+
+    template <class K, class V>
+    bool persistent_stack<K, V>::const_iterator::operator!=(const const_iterator& iter) const noexcept {
+        return !operator==(iter);
+    }
+
+    template <class K, class V>
+    void persistent_stack<K, V>::const_iterator::descend(const node_t* root) noexcept {
+        // The next key is the leftmost one of the subtree.
+        for (; root != nullptr; root = root->left.get())
+            path[depth++] = root;
+    }
+}
@@ -1,6 +1,21 @@
 #include "stack.h"
+#include "persistent_stack.h"
+#include "concurrent_stack.h"
+#include "sharded_stack.h"
+#include "mapped_stack.h"
+#include "async_stack.h"
+#include <atomic>
+#include <coroutine>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <assert.h>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 using namespace cxx;
 
@@ -38,7 +53,8 @@ bool peq(std::pair<A, B> x, std::pair<C, D> y) {
 	return x.first == y.first && x.second == y.second;
 }
 
-bool has_elements(stack<int, int>& s, const std::vector<std::pair<int, int>>& vals) {
+template <class Policy>
+bool has_elements(stack<int, int, Policy>& s, const std::vector<std::pair<int, int>>& vals) {
 	if (s.size() != vals.size()) return false;
 	for (int i = vals.size() - 1; i >= 0; --i) {
 		auto top = s.front();
@@ -48,6 +64,194 @@ bool has_elements(stack<int, int>& s, const std::vector<std::pair<int, int>>& va
 	return true;
 }
 
+struct hash_policy : stack_policy {
+	template <class Key, class Alloc>
+	using key_index = hash_index<Key, Alloc>;
+};
+
+struct flat_policy : stack_policy {
+	template <class Key, class Alloc>
+	using key_index = flat_index<Key, Alloc>;
+};
+
+struct local_policy : stack_policy {
+	template <class T>
+	using data_ptr = local_ptr<T>;
+};
+
+struct counting_policy : stack_policy {
+	using stats = counting_stats;
+};
+
+struct transparent_policy : stack_policy {
+	template <class Key, class Alloc>
+	using key_index = ordered_index<Key, Alloc, std::less<>>;
+};
+
+struct deferred_policy : stack_policy {
+	using reclaimer = background_reclaimer;
+};
+
+struct local_deferred_policy : local_policy {
+	using reclaimer = background_reclaimer;
+};
+
+struct parallel_policy : stack_policy {
+	static constexpr size_t parallel_copy = 1000;
+};
+
+// Random operations checked against a plain vector.
+template <class Policy>
+void random_ops() {
+	std::vector<std::pair<int, int>> model;
+	stack<int, int, Policy> s;
+	unsigned seed = 12345;
+	auto next_rand = [&seed]() { seed = seed * 1103515245 + 12345; return (seed >> 16) & 0x7fff; };
+	// A periodic copy, so that some pops detach shared data.
+	stack<int, int, Policy> held;
+	std::vector<std::pair<int, int>> held_model;
+	for (int i = 0; i < 20000; i++) {
+		int op = next_rand() % 7, key = next_rand() % 16;
+		if (i % 7 == 0) {
+			held = s;
+			held_model = model;
+		}
+		if (op < 2) {
+			s.push(key, i);
+			model.push_back({key, i});
+		} else if (op == 2 && !model.empty()) {
+			s.pop();
+			model.pop_back();
+		} else if (op == 3) {
+			size_t n = std::min<size_t>(key % 4, model.size());
+			s.pop_n(n);
+			model.resize(model.size() - n);
+		} else if (op == 4 && s.count(key) > 0 && key % 3 == 0) {
+			s.pop_all(key);
+			std::erase_if(model, [key](auto& el) { return el.first == key; });
+		} else if (op == 5 && !model.empty() && key % 2 == 0) {
+			s.pop_bottom();
+			model.erase(model.begin());
+		} else if (op == 5 && s.count(key) > 0) {
+			s.pop_bottom(key);
+			model.erase(std::ranges::find(model, key, &std::pair<int, int>::first));
+		} else if (s.count(key) > 0) {
+			s.pop(key);
+			for (size_t j = model.size(); j-- > 0;)
+				if (model[j].first == key) { model.erase(model.begin() + j); break; }
+		}
+		if (i % 1000 == 0) {
+			// Keys must be listed in increasing order.
+			int prev = -1;
+			for (auto it = s.cbegin(); it != s.cend(); ++it) {
+				assert(*it > prev && s.count(*it) > 0);
+				prev = *it;
+			}
+			// The values of a key stop at its bottom one.
+			std::vector<int> values;
+			for (size_t j = model.size(); j-- > 0;)
+				if (model[j].first == key) values.push_back(model[j].second);
+			assert(std::ranges::equal(s.values(key), values));
+			stack<int, int, Policy> copy(s);
+			assert(has_elements(copy, model));
+			assert(has_elements(held, held_model));
+		}
+	}
+	assert(has_elements(s, model));
+}
+
+// Throws on the copy after the countdown reaches zero.
+struct fragile {
+	static inline std::atomic<int> countdown = -1;
+	int x;
+	fragile(int x) : x(x) {}
+	fragile(const fragile& other) : x(other.x) {
+		if (countdown >= 0 && countdown-- == 0) throw std::runtime_error("fragile");
+	}
+	friend bool operator<(const fragile& a, const fragile& b) { return a.x < b.x; }
+};
+
+// Throws on the comparison after the countdown reaches zero.
+struct touchy {
+	static inline int countdown = -1;
+	int x;
+	friend bool operator<(const touchy& a, const touchy& b) {
+		if (countdown >= 0 && countdown-- == 0) throw std::runtime_error("touchy");
+		return a.x < b.x;
+	}
+	friend bool operator==(const touchy& a, const touchy& b) { return a.x == b.x; }
+};
+
+template <>
+struct std::hash<touchy> {
+	size_t operator()(const touchy& t) const noexcept { return std::hash<int>()(t.x); }
+};
+
+// Records the threads it is destroyed on.
+struct tracked {
+	static inline std::atomic<int> alive = 0;
+	static inline std::atomic<int> foreign = 0;
+	std::thread::id owner = std::this_thread::get_id();
+	tracked() { ++alive; }
+	tracked(const tracked&) { ++alive; }
+	~tracked() {
+		--alive;
+		if (std::this_thread::get_id() != owner) ++foreign;
+	}
+};
+
+// Counts its copies, so that we can check none are made needlessly.
+struct counted {
+	static inline int copies = 0;
+	int x;
+	counted(int x) : x(x) {}
+	counted(const counted& other) : x(other.x) { ++copies; }
+	counted(counted&& other) noexcept : x(other.x) {}
+};
+
+// Reads another stack when copied.
+struct reading {
+	static inline concurrent_stack<int, int>* other = nullptr;
+	size_t seen = 0;
+	reading() = default;
+	reading(const reading&) : seen(other->size()) {}
+};
+
+// A coroutine that starts right away and that nothing awaits.
+struct detached {
+	struct promise_type {
+		detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+detached consume(async_stack<int, std::string>& s, std::vector<std::string>& got, int n) {
+	for (int i = 0; i < n; i++) {
+		auto [key, value] = co_await s.async_pop();
+		got.push_back(std::to_string(key) + value);
+	}
+}
+
+detached consume(async_stack<int, std::string>& s, int key, std::vector<std::string>& got) {
+	got.push_back(co_await s.async_pop(key));
+}
+
+detached consume(async_stack<int, fragile>& s, int key, bool& failed) {
+	try {
+		co_await s.async_pop(key);
+	} catch (std::runtime_error&) {
+		failed = true;
+	}
+}
+
+detached consume(async_stack<int, int>& s, std::atomic<int>& sum, int n) {
+	for (int i = 0; i < n; i++)
+		sum += (co_await s.async_pop()).second;
+}
+
 int main() {
 
 	// ----------------------------------------------------------------------------
@@ -156,5 +360,875 @@ int main() {
 		} catch(...) {}
 	}
 	assert(ctr == 4);
+
+	// ----------------------------------------------------------------------------
+	stack<int, counted> stick1;
+	counted c1(1);
+	stick1.push(1, c1);
+	assert(counted::copies == 1);
+	stick1.push(1, counted(2));
+	stick1.push(2, std::move(c1));
+	stick1.emplace(3, 4);
+	assert(counted::copies == 1);
+	assert(stick1.size() == 4 && stick1.count(1) == 2);
+	assert(stick1.front().second.x == 4 && stick1.front(1).x == 2);
+
+	// ----------------------------------------------------------------------------
+	// Popping shared data only copies the remaining values.
+	// (stick1 was made unsharable by front(), so it is copied first.)
+	stack<int, counted> stick0(stick1);
+	stick1 = stick0;
+	counted::copies = 0;
+	stack<int, counted> stick2(stick1);
+	stick2.pop();
+	assert(counted::copies == 3 && stick1.size() == 4 && stick2.size() == 3);
+	stack<int, counted> stick3(stick1);
+	stick3.pop(1);
+	assert(counted::copies == 6 && stick3.count(1) == 1 && stick3.front(1).x == 1);
+	stack<int, counted> stick4(stick1);
+	stick4.pop_n(3);
+	assert(counted::copies == 7 && stick4.size() == 1 && stick4.front().second.x == 1);
+	stick4.pop_n(0);
+	assert(counted::copies == 7 && stick4.size() == 1);
+	try {
+		stick4.pop_n(2);
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	assert(stick4.size() == 1 && stick1.size() == 4);
+
+	// ----------------------------------------------------------------------------
+	std::vector<std::pair<int, fragile>> batch;
+	for (int i = 0; i < 100; i++) batch.push_back({i % 10, fragile(i)});
+	stack<int, fragile> brittle1;
+	brittle1.push_range(batch.begin(), batch.end());
+	assert(brittle1.size() == 100 && brittle1.count(3) == 10 && std::as_const(brittle1).front().second.x == 99);
+	stack<int, fragile> brittle2(brittle1);
+	fragile::countdown = 50;
+	try {
+		brittle1.push_range(batch.begin(), batch.end());
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = 150; // The copy succeeds, but a push fails.
+	try {
+		brittle2.push_range(batch.begin(), batch.end());
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = -1;
+	assert(brittle1.size() == 100 && brittle1.count(3) == 10 && std::as_const(brittle1).front().second.x == 99);
+	assert(brittle2.size() == 100 && brittle2.count(3) == 10);
+	brittle2.pop_all(3);
+	assert(brittle2.size() == 90 && brittle2.count(3) == 0 && brittle1.count(3) == 10);
+	fragile::countdown = 5; // Now brittle2 isn't shared.
+	try {
+		brittle2.push_range(batch.begin(), batch.end());
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = -1;
+	assert(brittle2.size() == 90 && brittle2.count(3) == 0 && brittle2.front().second.x == 99);
+	brittle1.pop_all(9);
+	assert(brittle1.size() == 90 && std::as_const(brittle1).front().second.x == 98);
+	try {
+		brittle1.pop_all(9);
+		assert(false);
+	} catch (std::invalid_argument&) {}
+
+	// ----------------------------------------------------------------------------
+	stack<int, counted> stock1;
+	assert(!stock1.try_pop() && !stock1.try_pop(1) && !stock1.try_front() && !stock1.try_front(1));
+	stock1.push(1, counted(1));
+	stock1.push(2, counted(2));
+	stock1.push(1, counted(3));
+	assert(stock1.try_front(1)->x == 3 && !std::as_const(stock1).try_front(3));
+	assert(std::as_const(stock1).try_front()->first == 1);
+	stack<int, counted> stock2(stock1);
+	stock2.push(3, counted(4));
+	counted::copies = 0;
+	assert(stock2.extract().x == 4 && counted::copies == 0); // Moved out.
+	stack<int, counted> stock3(stock2);
+	// Shared, so the two remaining values and the result are copied.
+	assert(stock3.extract().x == 3 && counted::copies == 3);
+	assert(stock2.size() == 3 && stock3.size() == 2 && stock3.front(1).x == 1);
+	assert(stock3.try_pop(2) && !stock3.try_pop(2) && stock3.try_pop() && !stock3.try_pop());
+	try {
+		stock3.extract();
+		assert(false);
+	} catch (std::invalid_argument&) {}
+
+	// ----------------------------------------------------------------------------
+	stack<std::string, int, transparent_policy> strand1;
+	strand1.push("a", 1);
+	strand1.push("b", 2);
+	strand1.push("a", 3);
+	auto handle_a = strand1.find(std::string_view("a"));
+	assert(handle_a && !strand1.find(std::string_view("c")) && strand1.count(handle_a) == 2);
+	stack<std::string, int, transparent_policy> strand2(strand1);
+	// A handle stays valid when the data is detached, and in copies.
+	strand1.pop(handle_a);
+	assert(strand1.count(handle_a) == 1 && strand1.front(handle_a) == 1);
+	assert(strand2.count(handle_a) == 2 && std::as_const(strand2).front(handle_a) == 3);
+	strand1.front(handle_a) = 4;
+	assert(strand1.front("a") == 4 && strand2.front("a") == 3);
+	strand1.pop(handle_a);
+	assert(strand1.count(handle_a) == 0 && strand1.size() == 1);
+	try {
+		strand1.pop(decltype(strand1)::key_handle());
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	stack<std::string, int, hash_policy> strand3;
+	strand3.push("x", 1);
+	assert(strand3.count(strand3.find(std::string("x"))) == 1 && !strand3.find(std::string("y")));
+	stack<std::string, int, flat_policy> strand4;
+	strand4.push("x", 1);
+	assert(strand4.count(strand4.find(std::string_view("x"))) == 1 && !strand4.find(std::string_view("y")));
+
+	// ----------------------------------------------------------------------------
+	stack<int, int, counting_policy> stat1;
+	stat1.push(1, 1);
+	stat1.push(2, 2);
+	assert(stat1.count(1) == 1 && stat1.stats().snapshot().lookups == 3);
+	stack<int, int, counting_policy> stat2(stat1);
+	stat2.pop();
+	assert(stat1.stats().snapshot().shared_copies == 1 && stat2.stats().snapshot().deep_copies == 1);
+	assert(stat2.stats().snapshot().deep_copied_elements == 1 && stat1.stats().snapshot().deep_copies == 0);
+	stat2.front();
+	stack<int, int, counting_policy> stat3(stat2);
+	assert(stat2.stats().snapshot().unsharable_transitions == 1 && stat3.stats().snapshot().deep_copies == 2);
+	try {
+		stat3.pop(5);
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	assert(stat3.stats().snapshot().invalid_arguments == 1 && stat3.stats().snapshot().allocations > 0);
+	assert(counting_stats::global_snapshot().deep_copies == 2);
+
+	stack<int, fragile> brittle3;
+	brittle3.push(1, fragile(1));
+	fragile::countdown = 0;
+	try {
+		brittle3.extract();
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = -1;
+	assert(brittle3.size() == 1 && brittle3.extract().x == 1 && brittle3.size() == 0);
+
+	// ----------------------------------------------------------------------------
+	stack<int, int> stark1;
+	stark1.push(1, 1);
+	stark1.push(2, 2);
+	{
+		auto guard = stark1.modify_front();
+		assert(guard.key() == 2);
+		guard.value() = 3;
+		// A guard is alive, so this is a full copy.
+		stack<int, int> stark2(stark1);
+		guard.value() = 4;
+		assert(stark2.front().second == 3);
+	}
+	assert(stark1.front().second == 4);
+	stack<int, int> stark3(stark1);
+	// The guard is gone, so stark3 shares and detaches on update.
+	assert(stark3.update_front(1, [](const int& k, int& v) { v = 10; return k; }) == 1);
+	assert(stark3.front(1) == 10 && std::as_const(stark1).front(1) == 1);
+
+	// ----------------------------------------------------------------------------
+	persistent_stack<int, int> pers1;
+	pers1.push(1, 1);
+	pers1.push(2, 2);
+	persistent_stack<int, int> pers2 = pers1;
+	pers2.push(1, 3);
+	pers2.update_front(2, [](const int&, int& v) { v = 4; });
+	assert(pers1.size() == 2 && pers1.front().second == 2 && pers1.count(1) == 1);
+	assert(pers2.size() == 3 && pers2.front().second == 3 && pers2.front(2) == 4);
+	pers2.pop(1);
+	pers2.pop();
+	assert(pers2.front().first == 1 && pers2.front().second == 1 && pers2.count(2) == 0);
+	assert(*pers1.cbegin() == 1 && *++pers1.cbegin() == 2);
+
+	// ----------------------------------------------------------------------------
+	concurrent_stack<int, int> conc1;
+	{
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&conc1, t] {
+				for (int i = 0; i < 1000; i++) conc1.push(t, i);
+				for (int i = 0; i < 500; i++) conc1.pop(t);
+			});
+		}
+		threads.emplace_back([&conc1] {
+			// Every snapshot is consistent.
+			for (int i = 0; i < 1000; i++) {
+				auto snap = conc1.snapshot();
+				size_t total = 0;
+				for (int t = 0; t < 4; t++) total += snap->count(t);
+				assert(total == snap->size());
+			}
+		});
+		for (auto& thread : threads) thread.join();
+	}
+	assert(conc1.size() == 2000 && conc1.count(0) == 500 && conc1.front(3) == 499);
+	auto conc_snap = conc1.snapshot();
+	conc1.clear();
+	try {
+		conc1.front();
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	conc1.push(1, 1);
+	conc1.update_front([](const int&, int& v) { v = 2; });
+	assert(conc1.front().second == 2 && conc1.size() == 1 && conc_snap->size() == 2000);
+	// Readers read in place while the writers replace the snapshots.
+	concurrent_stack<int, int> conc2;
+	{
+		std::atomic<bool> writing = true;
+		std::vector<std::thread> threads;
+		threads.emplace_back([&conc2, &writing] {
+			for (int i = 0; i < 2000; i++) conc2.push(i % 2, i);
+			for (int i = 0; i < 1000; i++) conc2.pop(0);
+			writing = false;
+		});
+		for (int t = 0; t < 3; t++) {
+			threads.emplace_back([&conc2, &writing] {
+				while (writing) {
+					assert(conc2.size() <= 2000 && conc2.count(1) <= 1000);
+					if (conc2.count(1) > 0) assert(conc2.front(1) % 2 == 1);
+				}
+			});
+		}
+		for (auto& thread : threads) thread.join();
+	}
+	assert(conc2.size() == 1000 && conc2.count(0) == 0 && conc2.front().second == 1999);
+	// Replaced snapshots are destroyed once nothing reads them.
+	{
+		concurrent_stack<int, tracked> conc3;
+		for (int i = 0; i < 100; i++) conc3.push(i % 3, tracked());
+		auto conc3_snap = conc3.snapshot();
+		for (int i = 0; i < 100; i++) conc3.pop();
+		assert(tracked::alive == 100 && conc3.size() == 0);
+		conc3_snap = nullptr;
+		conc3.push(1, tracked());
+		assert(tracked::alive == 1);
+	}
+	assert(tracked::alive == 0);
+	// Reads may be nested, e.g. in a copy of the value read.
+	reading::other = &conc2;
+	concurrent_stack<int, reading> conc4;
+	conc4.push(1, reading());
+	assert(conc4.front(1).seen == 1000 && conc4.front().second.seen == 1000);
+
+	// ----------------------------------------------------------------------------
+	sharded_stack<int, int> shard1(4);
+	for (int i = 0; i < 20; i++) shard1.push(i % 5, i);
+	assert(shard1.size() == 20 && shard1.count(2) == 4 && shard1.front(2) == 17);
+	// The global order is kept across the shards.
+	for (int i = 19; i >= 10; i--) {
+		assert(shard1.front() == std::make_pair(i % 5, i));
+		shard1.pop();
+	}
+	shard1.pop(0);
+	assert(shard1.front().second == 9 && shard1.count(0) == 1 && shard1.size() == 9);
+	{
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&shard1, t] {
+				for (int i = 0; i < 1000; i++) shard1.push(10 + t, i);
+				for (int i = 0; i < 400; i++) shard1.pop(10 + t);
+				for (int i = 0; i < 100; i++) shard1.pop();
+			});
+		}
+		for (auto& thread : threads) thread.join();
+	}
+	assert(shard1.size() == 9 + 4 * 500);
+	shard1.clear();
+	try {
+		shard1.pop();
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	assert(shard1.size() == 0 && shard1.count(10) == 0);
+	// Clearing can only fail if it allocates, i.e. under a deferred reclaimer.
+	static_assert(noexcept(shard1.clear()));
+	sharded_stack<int, int, std::hash<int>, deferred_policy> shard2(2);
+	static_assert(!noexcept(shard2.clear()));
+	for (int i = 0; i < 10; i++) shard2.push(i % 3, i);
+	shard2.clear();
+	shard2.push(1, 1);
+	assert(shard2.size() == 1 && shard2.front(1) == 1);
+
+	// ----------------------------------------------------------------------------
+	// Trivially copyable elements are stored compactly, the others aren't:
+	// both must behave the same.
+	struct point { int x, y; };
+	stack<int, point> comp1;
+	stack<int, std::string> comp2;
+	for (int i = 0; i < 100; i++) {
+		comp1.push(i % 7, point{i, -i});
+		comp2.push(i % 7, std::to_string(i));
+	}
+	stack<int, point> comp3(comp1);
+	stack<int, std::string> comp4(comp2);
+	// Popping shared data filters the popped elements out of the copy.
+	comp3.pop(3);
+	comp3.pop();
+	comp4.pop(3);
+	comp4.pop();
+	assert(comp3.size() == 98 && comp3.count(3) == 13 && std::as_const(comp3).front(3).x == 87);
+	assert(comp4.size() == 98 && comp4.count(3) == 13 && std::as_const(comp4).front(3) == "87");
+	assert(std::as_const(comp1).front().second.x == 99 && comp1.count(3) == 14);
+	// Freed slots are reused.
+	comp3.push(3, point{1000, 0});
+	comp4.push(3, "1000");
+	assert(std::as_const(comp3).front(3).x == 1000 && std::as_const(comp4).front(3) == "1000");
+	comp3.clear();
+	comp3.push(1, point{1, 1});
+	assert(comp3.size() == 1 && comp3.count(3) == 0 && comp1.size() == 100);
+	// Trivially copyable values needn't be assignable.
+	struct fixed {
+		const int x;
+		fixed(int x) : x(x) {}
+	};
+	stack<int, fixed> comp5;
+	for (int i = 0; i < 100; i++) comp5.push(i % 7, fixed(i));
+	stack<int, fixed> comp6(comp5);
+	comp6.pop(3);
+	comp6.pop();
+	comp6.push(3, fixed(1000));
+	assert(std::as_const(comp6).front(3).x == 1000 && comp6.count(3) == 14);
+	comp6.reserve(200, 10);
+	comp6.shrink_to_fit();
+	stack<int, fixed> comp7(comp6);
+	comp7.push(8, fixed(-1));
+	assert(comp7.size() == 100 && std::as_const(comp7).front().second.x == -1);
+	assert(std::as_const(comp5).front().second.x == 99 && comp5.size() == 100);
+	std::stringstream comp_image;
+	comp5.serialize(comp_image);
+	stack<int, fixed> comp8 = stack<int, fixed>::deserialize(comp_image);
+	assert(comp8.size() == 100 && std::as_const(comp8).front(3).x == 94);
+	comp8.clear();
+	comp8.push(1, fixed(1));
+	assert(comp8.size() == 1 && comp8.count(3) == 0);
+
+	// ----------------------------------------------------------------------------
+	stack<int, std::string> room1;
+	room1.reserve(1000, 10);
+	assert(room1.capacity() >= 1000 && room1.size() == 0);
+	for (int i = 0; i < 1000; i++) room1.push(i % 10, std::to_string(i));
+	assert(room1.capacity() >= 1000 && room1.size() == 1000);
+	room1.pop_n(900);
+	room1.shrink_to_fit();
+	assert(room1.capacity() < 1000 && room1.size() == 100 && std::as_const(room1).front(9) == "99");
+	room1.push(1, "x");
+	assert(std::as_const(room1).front().second == "x" && room1.count(1) == 11);
+	// Reserving on shared data detaches it with a single copy.
+	stack<int, int, counting_policy> room2;
+	room2.push(1, 1);
+	stack<int, int, counting_policy> room3(room2);
+	size_t room_copies = room3.stats().snapshot().deep_copies;
+	room3.reserve(500, 100);
+	assert(room3.stats().snapshot().deep_copies == room_copies + 1 && room3.capacity() >= 500);
+	for (int i = 0; i < 499; i++) room3.push(i % 100, i);
+	assert(room3.stats().snapshot().deep_copies == room_copies + 1 && room2.size() == 1);
+	// Shared data isn't copied only to be shrunk.
+	stack<int, int, counting_policy> room4(room2);
+	room_copies = room2.stats().snapshot().deep_copies;
+	room2.shrink_to_fit();
+	assert(room2.stats().snapshot().deep_copies == room_copies && std::as_const(room4).front(1) == 1);
+
+	// ----------------------------------------------------------------------------
+	// The cached front follows every operation that changes it.
+	stack<int, int> top1;
+	top1.push(1, 1);
+	top1.push(2, 2);
+	top1.push(1, 3);
+	top1.pop(1);
+	assert(peq(std::as_const(top1).front(), std::make_pair(2, 2)));
+	top1.reserve(1000);
+	assert(peq(std::as_const(top1).front(), std::make_pair(2, 2)));
+	top1.pop_all(2);
+	assert(peq(std::as_const(top1).front(), std::make_pair(1, 1)));
+	stack<int, int> top2(top1);
+	top2.push(3, 3);
+	assert(peq(std::as_const(top2).front(), std::make_pair(3, 3)));
+	assert(peq(std::as_const(top1).front(), std::make_pair(1, 1)));
+	top2.pop_n(2);
+	assert(!std::as_const(top2).try_front());
+	top1.clear();
+	try {
+		std::as_const(top1).front();
+		assert(false);
+	} catch (std::invalid_argument&) {}
+
+	// ----------------------------------------------------------------------------
+	static_assert(std::bidirectional_iterator<stack<int, int>::element_iterator>);
+	static_assert(std::forward_iterator<stack<int, int>::value_iterator>);
+	stack<int, std::string, counting_policy> view1;
+	for (int i = 0; i < 10; i++) view1.push(i % 3, std::to_string(i));
+	// Leave holes in the stack order.
+	view1.pop(1);
+	view1.pop(1);
+	const stack<int, std::string, counting_policy> view2(view1);
+	size_t view_copies = view2.stats().snapshot().deep_copies;
+	std::vector<std::pair<int, std::string>> view_seen;
+	for (auto [k, v] : view2.elements()) view_seen.emplace_back(k, v);
+	assert(view_seen.size() == 8 && view_seen.front() == std::make_pair(0, std::string("9")));
+	assert(view_seen[1] == std::make_pair(2, std::string("8")) && view_seen[2].second == "6");
+	assert(view_seen.back() == std::make_pair(0, std::string("0")));
+	std::vector<std::string> view_pushed;
+	for (auto [k, v] : view2.elements() | std::views::reverse) view_pushed.push_back(v);
+	assert(view_pushed.size() == 8 && view_pushed[1] == "1" && view_pushed[2] == "2");
+	std::vector<std::string> view_values(view2.values(1).begin(), view2.values(1).end());
+	assert(view_values == std::vector<std::string>({"1"}));
+	assert(std::ranges::distance(view2.values(0)) == 4 && *view2.values(0).begin() == "9");
+	assert(std::ranges::empty(view2.values(5)) && std::ranges::empty(stack<int, int>().elements()));
+	assert(view2.stats().snapshot().deep_copies == view_copies);
+
+	// ----------------------------------------------------------------------------
+	stack<int, double, hash_policy> image1;
+	for (int i = 0; i < 50; i++) image1.push(i % 7 * 10, i / 2.0);
+	image1.pop(30);
+	image1.pop(30);
+	std::stringstream image_stream;
+	image1.serialize(image_stream);
+	auto image2 = stack<int, double, hash_policy>::deserialize(image_stream);
+	assert(image2.size() == 48 && image2.count(30) == 5 && image2.count(40) == 7);
+	assert(std::ranges::equal(image1.elements(), image2.elements()));
+	assert(std::ranges::equal(image1.values(30), image2.values(30)));
+	image2.push(30, -1);
+	assert(std::as_const(image2).front(30) == -1 && image1.count(30) == 5);
+	// A damaged image is rejected.
+	std::string image_bytes = image_stream.str();
+	image_bytes[0] = 'X';
+	std::stringstream image_bad(image_bytes);
+	try {
+		stack<int, double, hash_policy>::deserialize(image_bad);
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	std::stringstream image_short(image_stream.str().substr(0, 100));
+	try {
+		stack<int, double, hash_policy>::deserialize(image_short);
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	// So is a header with absurd counts, before anything is allocated for them.
+	std::string image_huge_bytes = image_stream.str();
+	stack_image<int, double>::header_t image_huge_header;
+	std::memcpy(&image_huge_header, image_huge_bytes.data(), sizeof(image_huge_header));
+	image_huge_header.keys = image_huge_header.elements = UINT32_MAX;
+	std::memcpy(image_huge_bytes.data(), &image_huge_header, sizeof(image_huge_header));
+	std::stringstream image_huge(image_huge_bytes);
+	try {
+		stack<int, double, hash_policy>::deserialize(image_huge);
+		assert(false);
+	} catch (std::invalid_argument&) {}
+
+	auto image_path = (std::filesystem::temp_directory_path() / "cxx_sandbox_stack.bin").string();
+	{
+		std::ofstream image_file(image_path, std::ios::binary);
+		image1.serialize(image_file);
+	}
+	{
+		mapped_stack<int, double> mapped1(image_path);
+		assert(mapped1.is_mapped() && mapped1.size() == 48 && mapped1.count(30) == 5 && mapped1.count(31) == 0);
+		assert(peq(mapped1.front(), std::make_pair(0, 24.5)) && mapped1.front(30) == 15.5);
+		std::vector<int> mapped_keys(mapped1.cbegin(), mapped1.cend());
+		assert(mapped_keys == std::vector<int>({0, 10, 20, 30, 40, 50, 60}));
+		try {
+			mapped1.front(31);
+			assert(false);
+		} catch (std::invalid_argument&) {}
+		mapped1.pop(30);
+		assert(!mapped1.is_mapped() && mapped1.count(30) == 4 && mapped1.front(30) == 12.0);
+		mapped_keys.assign(mapped1.cbegin(), mapped1.cend());
+		assert(mapped_keys.size() == 7 && mapped1.get().size() == 47);
+	}
+	std::remove(image_path.c_str());
+	try {
+		mapped_stack<int, double> mapped2(image_path);
+		assert(false);
+	} catch (std::system_error&) {}
+
+	// ----------------------------------------------------------------------------
+	// Deep copies share their keys until their key sets differ.
+	stack<std::string, int> keys1;
+	for (int i = 0; i < 20; i++) keys1.push(std::to_string(i % 5), i);
+	stack<std::string, int> keys2(keys1);
+	keys2.push("1", 20); // A deep copy.
+	assert(&*keys1.cbegin() == &*keys2.cbegin());
+	keys2.push("5", 21);
+	assert(&*keys1.cbegin() != &*keys2.cbegin() && keys1.count("5") == 0);
+	assert(std::equal(keys1.cbegin(), keys1.cend(), keys2.cbegin()) && keys2.count("5") == 1);
+	stack<std::string, int> keys3(keys1);
+	keys3.pop();
+	keys3.pop_all("0");
+	keys3.pop_n(14);
+	assert(keys3.size() == 1 && keys3.count("0") == 0 && std::as_const(keys3).front().first == "1");
+	assert(keys1.size() == 20 && keys1.count("0") == 4 && *keys1.cbegin() == "0");
+	stack<std::string, int> keys4(keys1);
+	keys4.push("4", 22);
+	keys4.clear();
+	assert(keys4.size() == 0 && keys4.cbegin() == keys4.cend() && keys1.count("4") == 4);
+	// Neither the deep copy nor a push with an old key copies any key.
+	stack<fragile, int> keys5;
+	for (int i = 0; i < 10; i++) keys5.push(fragile(i % 3), i);
+	stack<fragile, int> keys6(keys5);
+	fragile::countdown = 0;
+	keys6.push(fragile(1), 10);
+	assert(keys6.size() == 11 && keys5.size() == 10 && keys6.count(fragile(1)) == 4);
+	// A new key copies the table, so a failure leaves the copy as it was.
+	try {
+		keys6.push(fragile(3), 11);
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = -1;
+	assert(keys6.size() == 11 && keys6.count(fragile(3)) == 0 && std::as_const(keys6).front().second == 10);
+	keys6.push(fragile(3), 11);
+	assert(keys6.count(fragile(3)) == 1 && keys5.count(fragile(3)) == 0);
+	// A push with an old key leaves the shared index as it was, so
+	// the iterators of the other copies stay valid.
+	stack<int, int, hash_policy> keys7;
+	for (int i = 0; i < 8; i++) keys7.push(i, i);
+	stack<int, int, hash_policy> keys8(keys7);
+	auto keys_it = keys8.cbegin();
+	keys7.push(3, 100);
+	assert(*keys_it == 0 && std::distance(keys_it, keys8.cend()) == 8);
+	// Copies sharing an unsorted index may sort it on different threads.
+	stack<int, int, hash_policy> keys9;
+	for (int i = 0; i < 1000; i++) keys9.push(i, i);
+	stack<int, int, hash_policy> keys10(keys9);
+	keys10.push(0, 0);
+	std::thread sorter([&keys9] { assert(*keys9.cbegin() == 0); });
+	assert(*std::prev(keys10.cend()) == 999);
+	sorter.join();
+	// A failed sort throws from cbegin, and is retried by the next one.
+	stack<touchy, int, hash_policy> keys11;
+	for (int i = 0; i < 100; i++) keys11.push(touchy{99 - i}, i);
+	static_assert(!noexcept(keys11.cbegin()) && noexcept(s.cbegin()));
+	touchy::countdown = 10;
+	try {
+		keys11.cbegin();
+		assert(false);
+	} catch (std::runtime_error&) {}
+	touchy::countdown = -1;
+	assert(keys11.cbegin()->x == 0 && std::distance(keys11.cbegin(), keys11.cend()) == 100);
+
+	// ----------------------------------------------------------------------------
+	stack<int, counted> merge1, merge2;
+	for (int i = 0; i < 6; i++) merge1.push(i % 3, counted(i));
+	for (int i = 0; i < 6; i++) merge2.push(i % 4, counted(10 + i));
+	counted::copies = 0;
+	merge1.splice_on_top(std::move(merge2));
+	assert(counted::copies == 0 && merge1.size() == 12 && merge2.size() == 0);
+	assert(merge1.count(0) == 4 && merge1.count(3) == 1 && std::as_const(merge1).front().second.x == 15);
+	assert(std::as_const(merge1).front(2).x == 12 && merge2.cbegin() == merge2.cend());
+	// A shared stack is copied from, and keeps its elements.
+	stack<int, counted> merge3;
+	merge3.push(7, counted(7));
+	stack<int, counted> merge4(merge3);
+	merge1.splice_on_top(std::move(merge3));
+	assert(counted::copies == 1 && merge1.size() == 13 && merge3.size() == 0 && merge4.count(7) == 1);
+	// Splicing onto an empty stack takes the data over.
+	stack<int, counted> merge5;
+	merge5.splice_on_top(std::move(merge4));
+	assert(counted::copies == 1 && merge5.size() == 1 && merge4.size() == 0);
+	try {
+		merge5.splice_on_top(std::move(merge5));
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	stack<int, counted> split1 = merge1.extract_keys(1, 3);
+	assert(counted::copies == 1 && split1.size() == 7 && merge1.size() == 6);
+	assert(split1.count(1) == 4 && split1.count(2) == 3 && merge1.count(1) == 0 && merge1.count(0) == 4);
+	assert(std::as_const(split1).front().second.x == 15 && std::as_const(merge1).front().second.x == 7);
+	stack<int, counted> split2(merge1);
+	stack<int, counted> split3 = split2.extract_keys(3, 10);
+	assert(counted::copies == 7 && split3.size() == 2 && split2.size() == 4 && merge1.size() == 6);
+	assert(split2.extract_keys(5, 7).size() == 0 && split2.size() == 4);
+	assert(split2.extract_keys(10, 0).size() == 0 && split2.size() == 4);
+	// Only the keys in the range are visited, with every key index.
+	auto split_check = [](auto& whole) {
+		for (int i = 0; i < 100; i++) whole.push(i % 10, i);
+		auto part = whole.extract_keys(3, 5);
+		assert(part.size() == 20 && part.count(4) == 10 && *part.cbegin() == 3 && *std::prev(part.cend()) == 4);
+		assert(whole.size() == 80 && whole.count(3) == 0 && whole.count(5) == 10 && std::as_const(whole).front().second == 99);
+	};
+	stack<int, int, hash_policy> split4;
+	stack<int, int, flat_policy> split5;
+	split_check(split4);
+	split_check(split5);
+	// A failed push leaves both stacks as they were.
+	stack<int, fragile> merge6, merge7;
+	for (int i = 0; i < 5; i++) merge6.push(i, fragile(i));
+	for (int i = 0; i < 5; i++) merge7.push(i, fragile(i));
+	stack<int, fragile> merge8(merge7);
+	fragile::countdown = 3;
+	try {
+		merge6.splice_on_top(std::move(merge7));
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = -1;
+	assert(merge6.size() == 5 && merge7.size() == 5 && std::as_const(merge7).front().second.x == 4);
+	// And moved values are given back.
+	stack<fragile, counted> merge9, merge10;
+	merge9.push(fragile(0), counted(0));
+	for (int i = 1; i < 4; i++) merge10.push(fragile(i), counted(i));
+	fragile::countdown = 1;
+	try {
+		merge9.splice_on_top(std::move(merge10));
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = -1;
+	assert(merge9.size() == 1 && merge10.size() == 3 && std::as_const(merge10).front(fragile(1)).x == 1);
+	assert(std::as_const(merge10).front().second.x == 3 && std::as_const(merge10).front(fragile(2)).x == 2);
+
+	// ----------------------------------------------------------------------------
+	// Range and order queries, the same with every key index.
+	auto ranges_check = [](auto& ranged) {
+		for (int i = 0; i < 30; i++) ranged.push(i % 10 * 10, i);
+		ranged.pop_all(50);
+		static_assert(std::bidirectional_iterator<std::remove_reference_t<decltype(ranged.cbegin())>>);
+		assert(*ranged.lower_bound(30) == 30 && *ranged.lower_bound(31) == 40 && *ranged.lower_bound(45) == 60);
+		assert(*ranged.upper_bound(30) == 40 && ranged.upper_bound(90) == ranged.cend());
+		assert(ranged.lower_bound(-5) == ranged.cbegin());
+		auto [from, to] = ranged.equal_range(20);
+		assert(std::distance(from, to) == 1 && *from == 20);
+		auto [none, none_end] = ranged.equal_range(55);
+		assert(none == none_end && *none == 60);
+		assert(*--ranged.cend() == 90 && *std::prev(ranged.lower_bound(60)) == 40);
+		assert(ranged.rank(0) == 0 && ranged.rank(40) == 4 && ranged.rank(60) == 5 && ranged.rank(100) == 9);
+		assert(ranged.nth_key(0) == 0 && ranged.nth_key(5) == 60 && ranged.nth_key(8) == 90);
+		try {
+			ranged.nth_key(9);
+			assert(false);
+		} catch (std::invalid_argument&) {}
+	};
+	stack<int, int> ranged1;
+	stack<int, int, hash_policy> ranged2;
+	stack<int, int, flat_policy> ranged3;
+	stack<int, int, transparent_policy> ranged4;
+	ranges_check(ranged1);
+	ranges_check(ranged2);
+	ranges_check(ranged3);
+	ranges_check(ranged4);
+	assert(*ranged4.lower_bound(35L) == 40 && ranged4.rank(65.0) == 6);
+
+	// ----------------------------------------------------------------------------
+	// Big deep copies are made by several threads.
+	stack<int, std::string, parallel_policy> wide1;
+	for (int i = 0; i < 5000; i++) wide1.push(i % 100, std::to_string(i));
+	wide1.pop(50);
+	stack<int, std::string, parallel_policy> wide2(wide1);
+	wide2.push(1, "x");
+	assert(wide2.size() == 5000 && wide1.size() == 4999 && std::as_const(wide1).front().second == "4999");
+	assert(std::ranges::equal(wide1.elements(), std::ranges::drop_view(wide2.elements(), 1)));
+	stack<int, std::string, parallel_policy> wide3(wide1);
+	wide3.pop(99);
+	assert(wide3.size() == 4998 && wide3.count(99) == 49 && wide1.count(99) == 50);
+	assert(std::ranges::equal(wide1.values(98), wide3.values(98)));
+	// A failure on any thread fails the copy.
+	stack<int, fragile, parallel_policy> wide4;
+	for (int i = 0; i < 5000; i++) wide4.push(i % 100, fragile(i));
+	stack<int, fragile, parallel_policy> wide5(wide4);
+	fragile::countdown = 4000;
+	try {
+		wide5.push(1, fragile(-1));
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = -1;
+	assert(wide5.size() == 5000 && std::as_const(wide5).front().second.x == 4999);
+
+	// ----------------------------------------------------------------------------
+	// Dropped data is destroyed by the background thread.
+	{
+		stack<int, tracked, deferred_policy> gone1;
+		for (int i = 0; i < 1000; i++) gone1.emplace(i % 10);
+		stack<int, tracked, deferred_policy> gone2(gone1);
+		gone1.clear();
+		// Still shared with gone2, so nothing is retired.
+		background_reclaimer::drain();
+		assert(tracked::alive == 1000 && tracked::foreign == 0 && gone1.size() == 0);
+		gone1.emplace(1);
+		gone2 = gone1;
+		background_reclaimer::drain();
+		assert(tracked::alive == 1 && tracked::foreign == 1000 && gone2.count(1) == 1);
+	}
+	background_reclaimer::drain();
+	assert(tracked::alive == 0 && tracked::foreign == 1001);
+	// A key index still shared with a deep copy is released by the
+	// dropping thread, as the counts of local_ptr aren't atomic.
+	stack<int, int, local_deferred_policy> gone3;
+	for (int i = 0; i < 100; i++) gone3.push(i % 10, i);
+	{
+		stack<int, int, local_deferred_policy> gone4(gone3);
+		gone4.push(1, 100);
+		assert(gone3.memory_usage().shared > 0);
+	}
+	assert(gone3.memory_usage().shared == 0 && gone3.count(1) == 10);
+	gone3.push(10, 10);
+	assert(gone3.count(10) == 1);
+
+	// ----------------------------------------------------------------------------
+	// Bounded stacks evict their bottom elements.
+	stack<int, int> bounded1;
+	bounded1.set_bounds(5);
+	for (int i = 0; i < 100; i++) bounded1.push(i % 3, i);
+	assert(bounded1.size() == 5 && bounded1.bounds().first == 5 && bounded1.bounds().second == 0);
+	assert(bounded1.count(0) == 2 && bounded1.count(1) == 1 && bounded1.count(2) == 2);
+	assert(std::ranges::equal(bounded1.values(2), std::vector{98, 95}));
+	stack<int, int> bounded2;
+	bounded2.set_bounds(0, 2);
+	for (int i = 0; i < 10; i++) bounded2.push(i % 3, i);
+	assert(has_elements(bounded2, {{1, 4}, {2, 5}, {0, 6}, {1, 7}, {2, 8}, {0, 9}}));
+	// Copies keep the bounds.
+	stack<int, int> bounded3(bounded1);
+	bounded3.push(7, 100);
+	assert(bounded3.bounds() == bounded1.bounds() && bounded3.size() == 5 && bounded3.count(2) == 1);
+	assert(std::as_const(bounded1).front().second == 99 && bounded1.count(2) == 2);
+	// New bounds evict right away, in the key's elements first.
+	stack<int, int> bounded4;
+	for (int i = 0; i < 20; i++) bounded4.push(i % 4, i);
+	stack<int, int> bounded5(bounded4);
+	bounded4.set_bounds(3, 2);
+	assert(bounded5.size() == 20 && bounded5.bounds().first == 0);
+	assert(has_elements(bounded4, {{1, 17}, {2, 18}, {3, 19}}));
+	bounded5.set_bounds(0, 2);
+	assert(bounded5.size() == 8 && std::ranges::equal(bounded5.values(0), std::vector{16, 12}));
+	// Bulk pushes are bounded as well.
+	stack<int, int> bounded6;
+	bounded6.set_bounds(3, 1);
+	std::vector<std::pair<int, int>> bulk{{1, 1}, {1, 2}, {2, 3}, {1, 4}, {3, 5}};
+	bounded6.push_range(bulk.begin(), bulk.end());
+	stack<int, int> bounded7;
+	bounded7.push(2, 6);
+	bounded7.push(4, 7);
+	stack<int, int> bounded8(bounded6);
+	bounded6.splice_on_top(std::move(bounded7));
+	assert(has_elements(bounded6, {{3, 5}, {2, 6}, {4, 7}}));
+	assert(has_elements(bounded8, {{2, 3}, {1, 4}, {3, 5}}));
+	// Popping from the bottom leaves the links above consistent.
+	stack<int, int> bottom1;
+	bottom1.push(1, 1);
+	bottom1.push(2, 2);
+	bottom1.push(1, 3);
+	bottom1.push(3, 4);
+	stack<int, int> bottom2(bottom1);
+	bottom1.pop_bottom();
+	bottom1.push(4, 5);
+	assert(std::ranges::equal(bottom1.values(1), std::vector{3}) && bottom2.count(1) == 2);
+	bottom1.pop_bottom(4);
+	bottom1.pop_bottom(3);
+	assert(std::as_const(bottom1).front().second == 3 && bottom1.size() == 2);
+	bottom1.pop(1);
+	assert(bottom1.count(1) == 0 && *bottom1.cbegin() == 2 && std::next(bottom1.cbegin()) == bottom1.cend());
+	bottom2.pop_bottom(1);
+	bottom2.pop_all(1);
+	assert(has_elements(bottom2, {{2, 2}, {3, 4}}));
+	try {
+		bottom2.pop_bottom();
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	try {
+		bottom1.pop_bottom(9);
+		assert(false);
+	} catch (std::invalid_argument&) {}
+	// Memory stays flat under sustained pushes.
+	stack<int, std::string, counting_policy> bounded9;
+	bounded9.set_bounds(100, 10);
+	for (int i = 0; i < 1000; i++) bounded9.push(i % 20, std::to_string(i));
+	size_t upstream = bounded9.stats().snapshot().upstream_allocations;
+	for (int i = 0; i < 100000; i++) bounded9.push(i % 30, std::to_string(i));
+	assert(bounded9.stats().snapshot().upstream_allocations == upstream && bounded9.size() == 100);
+	assert(bounded9.count(29) == 3 && std::as_const(bounded9).front().second == "99999");
+	// A failed bounded push leaves the stack as it was.
+	stack<int, fragile> bounded10;
+	bounded10.set_bounds(3);
+	for (int i = 0; i < 5; i++) bounded10.push(i, fragile(i));
+	stack<int, fragile> bounded11(bounded10);
+	fragile::countdown = 1;
+	try {
+		bounded11.push(9, fragile(9));
+		assert(false);
+	} catch (std::runtime_error&) {}
+	fragile::countdown = -1;
+	assert(bounded11.size() == 3 && bounded11.count(2) == 1 && std::as_const(bounded11).front().second.x == 4);
+	// Long keys evict their bottom elements without walking down to them.
+	stack<int, int> bounded12;
+	bounded12.set_bounds(0, 1000);
+	for (int i = 0; i < 100000; i++) bounded12.push(i % 2, i);
+	assert(bounded12.size() == 2000 && bounded12.count(0) == 1000);
+	bounded12.pop_bottom(1);
+	auto odd = bounded12.values(1);
+	assert(std::ranges::distance(odd) == 999 && *odd.begin() == 99999 && *std::ranges::next(odd.begin(), 998) == 98003);
+	bounded12.pop_bottom();
+	bounded12.push(0, 100000);
+	assert(bounded12.count(0) == 1000 && std::ranges::equal(bounded12.values(0) | std::views::drop(998), std::vector{98004, 98002}));
+
+	// ----------------------------------------------------------------------------
+	// Memory accounting.
+	stack<int, int> mem1;
+	assert(mem1.memory_usage().values == 0 && mem1.memory_usage().exclusive == mem1.memory_usage().total());
+	for (int i = 0; i < 1000; i++) mem1.push(i % 10, i);
+	stack_memory used1 = mem1.memory_usage();
+	assert(used1.values == 1000 * sizeof(int) && used1.keys == 10 * sizeof(int) && used1.overhead > 0);
+	assert(used1.shared == 0 && used1.exclusive == used1.total());
+	stack<int, int> mem2(mem1);
+	assert(mem1.memory_usage().shared == used1.total() && mem2.memory_usage().exclusive == 0);
+	// A deep copy still shares the keys.
+	mem2.push(1, 1);
+	stack_memory used2 = mem2.memory_usage();
+	assert(used2.shared > 0 && used2.exclusive > 0 && mem1.memory_usage().shared == used2.shared);
+	// Popped memory is kept for later pushes.
+	mem1.pop_n(500);
+	stack_memory used3 = mem1.memory_usage();
+	assert(used3.values == 500 * sizeof(int) && used3.total() == used1.total());
+	mem1.pop_all(3);
+	stack_memory used4 = mem1.memory_usage();
+	assert(used4.keys == 9 * sizeof(int) && used4.free > 0 && used4.shared == 0);
+	stack<int, int, local_policy> mem3;
+	mem3.push(1, 1);
+	stack<int, int, local_policy> mem4(mem3);
+	assert(mem4.memory_usage().shared == mem4.memory_usage().total());
+	// A deep copy reserves room for its small blocks only, as the big
+	// arrays come straight from the allocator.
+	stack<int, int> mem5;
+	for (int i = 0; i < 100000; i++) mem5.push(i % 100, i);
+	stack<int, int> mem6(mem5);
+	mem6.push(1, 1);
+	assert(mem6.memory_usage().free * 100 < mem6.memory_usage().total());
+
+	// ----------------------------------------------------------------------------
+	// Coroutines wait for the elements, and are handed them by the pushes.
+	async_stack<int, std::string> queue1;
+	std::vector<std::string> got1, got2;
+	queue1.push(1, "a");
+	consume(queue1, got1, 3);
+	assert(got1 == std::vector<std::string>{"1a"} && queue1.waiting() == 1 && queue1.size() == 0);
+	consume(queue1, 5, got2);
+	queue1.push(2, "b");
+	assert(got1.size() == 2 && got1[1] == "2b" && got2.empty() && queue1.waiting() == 2);
+	// A bulk push wakes everyone it feeds, in the order they started waiting.
+	std::vector<std::pair<int, std::string>> burst{{5, "c"}, {3, "d"}, {5, "e"}};
+	queue1.push_range(burst.begin(), burst.end());
+	assert(got2 == std::vector<std::string>{"e"} && got1.size() == 3 && got1[2] == "3d");
+	assert(queue1.waiting() == 0 && queue1.size() == 1 && queue1.count(5) == 1);
+	assert(queue1.try_pop(5) == "c" && !queue1.try_pop() && !queue1.try_pop(5));
+	// A failure to take the element is thrown into the consumer.
+	async_stack<int, fragile> queue2;
+	bool failed = false;
+	consume(queue2, 1, failed);
+	fragile::countdown = 1;
+	queue2.push(1, fragile(1));
+	fragile::countdown = -1;
+	assert(failed && queue2.size() == 1 && queue2.waiting() == 0);
+	// Consumers are resumed on the producing thread.
+	async_stack<int, int> queue3;
+	std::atomic<int> consumed = 0;
+	consume(queue3, consumed, 500);
+	consume(queue3, consumed, 500);
+	std::thread producer([&queue3]() {
+		for (int i = 0; i < 1000; i++) queue3.push(i % 7, i);
+	});
+	producer.join();
+	assert(consumed == 999 * 1000 / 2 && queue3.size() == 0 && queue3.waiting() == 0);
+
+	// ----------------------------------------------------------------------------
+	random_ops<stack_policy>();
+	random_ops<hash_policy>();
+	random_ops<flat_policy>();
+	random_ops<local_policy>();
+	random_ops<deferred_policy>();
 	return 0;
 }
\ No newline at end of file
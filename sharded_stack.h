@@ -0,0 +1,216 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "stack.h"
+
+namespace cxx {
+
+    // A stack with the semantics of cxx::stack for many threads, whose
+    // keys are partitioned across shards. Each shard is a cxx::stack
+    // with its own mutex, so that keyed operations on keys from
+    // different shards don't contend.
+    //
+    // Every element is tagged with a global sequence number, which
+    // orders the elements across shards: the front of the whole stack
+    // is the shard top with the largest number. front() and pop() lock
+    // every shard (always in the same order) to find it.
+    //
+    // The front methods return copies, since the element may be popped
+    // by another thread at any time.
+    template <class K, class V, class Hash = std::hash<K>, class Policy = stack_policy>
+    class sharded_stack {
+    public:
+        // shards == 0 picks one shard per hardware thread.
+        explicit sharded_stack(size_t shards = 0);
+        sharded_stack(const sharded_stack&) = delete;
+        sharded_stack& operator=(const sharded_stack&) = delete;
+
+        void push(const K&, const V&);
+        void push(const K&, V&&);
+        void pop();
+        void pop(const K&);
+
+        std::pair<K, V> front() const;
+        V front(const K&) const;
+
+        size_t size() const noexcept;
+        size_t count(const K&) const;
+
+        // Only throws with a deferred reclaimer, under which clearing a
+        // stack allocates its fresh data. The shards cleared by then
+        // stay cleared.
+        void clear() noexcept(!Policy::reclaimer::deferred);
+
+        size_t shard_count() const noexcept;
+
+    private:
+        struct entry_t {
+            uint64_t seq;
+            V value;
+        };
+        struct shard_t {
+            mutable std::mutex lock;
+            stack<K, entry_t, Policy> elements;
+        };
+        using locks_t = std::vector<std::unique_lock<std::mutex>>;
+
+        std::unique_ptr<shard_t[]> shards;
+        size_t shards_size;
+        Hash hash;
+        std::atomic<uint64_t> next_seq;
+        std::atomic<size_t> elements;
+
+        shard_t& shard_of(const K&) const noexcept;
+        // Locks every shard, in order.
+        locks_t lock_all() const;
+        // The shard holding the front element, or nullptr if empty.
+        // Every shard must be locked.
+        shard_t* front_shard() const noexcept;
+        template <class Arg>
+        void push_entry(const K&, Arg&&);
+    };
+
+    // ---------- Implementations ---------- //
+
+    template <class K, class V, class Hash, class Policy>
+    sharded_stack<K, V, Hash, Policy>::sharded_stack(size_t shards)
+            : shards(nullptr)
+            , shards_size(shards > 0 ? shards : std::max(1u, std::thread::hardware_concurrency()))
+            , hash()
+            , next_seq(0)
+            , elements(0) {
+        this->shards = std::make_unique<shard_t[]>(shards_size);
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    void sharded_stack<K, V, Hash, Policy>::push(const K& key, const V& value) {
+        push_entry(key, value);
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    void sharded_stack<K, V, Hash, Policy>::push(const K& key, V&& value) {
+        push_entry(key, std::move(value));
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    void sharded_stack<K, V, Hash, Policy>::pop() {
+        locks_t locks = lock_all();
+        shard_t* shard = front_shard();
+        if (shard == nullptr)
+            throw std::invalid_argument("Tried to use pop() on empty stack.");
+
+        shard->elements.pop();
+        elements.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    void sharded_stack<K, V, Hash, Policy>::pop(const K& key) {
+        shard_t& shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        shard.elements.pop(key);
+        elements.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    std::pair<K, V> sharded_stack<K, V, Hash, Policy>::front() const {
+        locks_t locks = lock_all();
+        shard_t* shard = front_shard();
+        if (shard == nullptr)
+            throw std::invalid_argument("Tried to use front() on empty stack.");
+
+        auto [key, entry] = std::as_const(shard->elements).front();
+        return {key, entry.value};
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    V sharded_stack<K, V, Hash, Policy>::front(const K& key) const {
+        const shard_t& shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        return std::as_const(shard.elements).front(key).value;
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    size_t sharded_stack<K, V, Hash, Policy>::size() const noexcept {
+        return elements.load(std::memory_order_relaxed);
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    size_t sharded_stack<K, V, Hash, Policy>::count(const K& key) const {
+        const shard_t& shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        return shard.elements.count(key);
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    void sharded_stack<K, V, Hash, Policy>::clear() noexcept(!Policy::reclaimer::deferred) {
+        // Shards are cleared one by one, so a concurrent push
+        // to an already cleared shard is kept.
+        for (size_t i = 0; i < shards_size; i++) {
+            std::lock_guard<std::mutex> lock(shards[i].lock);
+            size_t cleared = shards[i].elements.size();
+            // Shards are never shared, so this only allocates
+            // (the fresh data) under a deferred reclaimer.
+            shards[i].elements.clear();
+            elements.fetch_sub(cleared, std::memory_order_relaxed);
+        }
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    size_t sharded_stack<K, V, Hash, Policy>::shard_count() const noexcept {
+        return shards_size;
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    sharded_stack<K, V, Hash, Policy>::shard_t&
+    sharded_stack<K, V, Hash, Policy>::shard_of(const K& key) const noexcept {
+        return shards[hash(key) % shards_size];
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    sharded_stack<K, V, Hash, Policy>::locks_t
+    sharded_stack<K, V, Hash, Policy>::lock_all() const {
+        locks_t locks;
+        locks.reserve(shards_size);
+        for (size_t i = 0; i < shards_size; i++)
+            locks.emplace_back(shards[i].lock);
+        return locks;
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    sharded_stack<K, V, Hash, Policy>::shard_t*
+    sharded_stack<K, V, Hash, Policy>::front_shard() const noexcept {
+        shard_t* result = nullptr;
+        uint64_t max_seq = 0;
+        for (size_t i = 0; i < shards_size; i++) {
+            const auto& shard_elements = shards[i].elements;
+            if (shard_elements.size() == 0) continue;
+            uint64_t seq = std::as_const(shard_elements).front().second.seq;
+            if (result == nullptr || seq > max_seq) {
+                result = &shards[i];
+                max_seq = seq;
+            }
+        }
+        return result;
+    }
+
+    template <class K, class V, class Hash, class Policy>
+    template <class Arg>
+    void sharded_stack<K, V, Hash, Policy>::push_entry(const K& key, Arg&& value) {
+        shard_t& shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.lock);
+        // Taken under the shard's lock, so that every shard is sorted
+        // by the numbers. A failed push just leaves a gap.
+        uint64_t seq = next_seq.fetch_add(1, std::memory_order_relaxed);
+        shard.elements.emplace(key, entry_t{seq, std::forward<Arg>(value)});
+        elements.fetch_add(1, std::memory_order_relaxed);
+    }
+}
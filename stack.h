@@ -1,109 +1,1160 @@
 #pragma once
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <deque>
+#include <exception>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace cxx {
 
+    // Key indices map every key of a stack to its key slot (a small
+    // integer chosen by the stack) and list the keys in increasing
+    // order. Handles to the entries are stable until the entry is
+    // erased. The index used is chosen by the key_index member of
+    // the stack policy. Deep copies of a stack share its index (see
+    // stack_data::table) as long as they insert no key, so neither
+    // its const methods nor try_emplace of a key already present
+    // may change it in a way visible to another thread or iterator.
+
+    // A balanced search tree. The default index. With a transparent
+    // Compare (e.g. std::less<>), keys can be found by any type
+    // comparable with K.
+    template <class K, class Alloc, class Compare = std::less<K>>
+    class ordered_index {
+        using value_type = std::pair<const K, size_t>;
+        using map_t = std::map<K, size_t, Compare,
+                typename std::allocator_traits<Alloc>::template rebind_alloc<value_type>>;
+    public:
+        using handle_t = map_t::iterator;
+        using const_iterator = map_t::const_iterator;
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        explicit ordered_index(const Alloc&);
+        ordered_index(const ordered_index&, const Alloc&);
+
+        // Returns the entry of the key, inserting it with the given
+        // slot if it isn't present yet (strong guarantee).
+        template <class KeyArg>
+        std::pair<handle_t, bool> try_emplace(KeyArg&&, size_t);
+        void erase(handle_t) noexcept;
+        void clear() noexcept;
+        // Makes room for the given number of keys, if the index
+        // can allocate ahead.
+        void reserve(size_t);
+
+        // Returns the slot of the key or npos.
+        template <class Q>
+        size_t find(const Q&) const;
+        const K& key(handle_t) const noexcept;
+        size_t slot(handle_t) const noexcept;
+        // Calls f(handle, slot) for every entry.
+        template <class F>
+        void for_each(F&&);
+
+        const_iterator begin() const noexcept;
+        const_iterator end() const noexcept;
+        // The first entry whose key isn't less than (is greater
+        // than) the given one.
+        template <class Q>
+        const_iterator lower_bound(const Q&) const;
+        template <class Q>
+        const_iterator upper_bound(const Q&) const;
+        // The key and the slot of the entry an iterator points to.
+        static const K& key_at(const_iterator) noexcept;
+        static size_t slot_at(const_iterator) noexcept;
+
+    private:
+        map_t map;
+    };
+
+    // A hash table. Lookups take expected constant time. The sorted
+    // order of keys is only computed when iterating after the key
+    // set has changed, which takes O(n log n) time, under a lock, so
+    // that sharing the index is safe. Comparing keys must not throw.
+    template <class K, class Alloc, class Hash = std::hash<K>, class KeyEqual = std::equal_to<K>>
+    class hash_index {
+        using value_type = std::pair<const K, size_t>;
+        using map_t = std::unordered_map<K, size_t, Hash, KeyEqual,
+                typename std::allocator_traits<Alloc>::template rebind_alloc<value_type>>;
+        using view_t = std::vector<const value_type*,
+                typename std::allocator_traits<Alloc>::template rebind_alloc<const value_type*>>;
+    public:
+        // Unordered map nodes are stable, even though iterators aren't.
+        using handle_t = value_type*;
+        using const_iterator = view_t::const_iterator;
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        explicit hash_index(const Alloc&);
+        hash_index(const hash_index&, const Alloc&);
+
+        template <class KeyArg>
+        std::pair<handle_t, bool> try_emplace(KeyArg&&, size_t);
+        void erase(handle_t) noexcept;
+        void clear() noexcept;
+        void reserve(size_t);
+
+        template <class Q>
+        size_t find(const Q&) const;
+        const K& key(handle_t) const noexcept;
+        size_t slot(handle_t) const noexcept;
+        template <class F>
+        void for_each(F&&);
+
+        // Iterators are invalidated when a key is inserted or erased.
+        // Sort the view first if the keys have changed, which throws
+        // whatever the mutex or K's operator< throws.
+        const_iterator begin() const;
+        const_iterator end() const;
+        // Binary searches of the sorted view, by operator<.
+        template <class Q>
+        const_iterator lower_bound(const Q&) const;
+        template <class Q>
+        const_iterator upper_bound(const Q&) const;
+        static const K& key_at(const_iterator) noexcept;
+        static size_t slot_at(const_iterator) noexcept;
+
+    private:
+        map_t map;
+        // The lazily sorted view. It always has the capacity
+        // for all the keys, so that sorting doesn't throw.
+        mutable view_t view;
+        mutable std::atomic<bool> view_valid;
+        // Taken by the const methods that sort the view.
+        mutable std::mutex sorting;
+
+        // A failed sort leaves the view invalid, to be sorted again.
+        void sort_view() const;
+    };
+
+    // A sorted array of keys. Lookups are binary searches over
+    // contiguous memory, but inserting and erasing a key takes
+    // linear time in the number of keys, so it suits small key sets.
+    template <class K, class Alloc>
+    class flat_index {
+        using entry_t = std::pair<const K*, size_t>;
+        using keys_t = std::deque<std::optional<K>,
+                typename std::allocator_traits<Alloc>::template rebind_alloc<std::optional<K>>>;
+        using entries_t = std::vector<entry_t,
+                typename std::allocator_traits<Alloc>::template rebind_alloc<entry_t>>;
+    public:
+        // Keys are stored by their slot.
+        using handle_t = size_t;
+        using const_iterator = entries_t::const_iterator;
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        explicit flat_index(const Alloc&);
+        flat_index(const flat_index&, const Alloc&);
+
+        template <class KeyArg>
+        std::pair<handle_t, bool> try_emplace(KeyArg&&, size_t);
+        void erase(handle_t) noexcept;
+        void clear() noexcept;
+        void reserve(size_t);
+
+        template <class Q>
+        size_t find(const Q&) const;
+        const K& key(handle_t) const noexcept;
+        size_t slot(handle_t) const noexcept;
+        template <class F>
+        void for_each(F&&);
+
+        // Iterators are invalidated when a key is inserted or erased.
+        const_iterator begin() const noexcept;
+        const_iterator end() const noexcept;
+        template <class Q>
+        const_iterator lower_bound(const Q&) const;
+        template <class Q>
+        const_iterator upper_bound(const Q&) const;
+        static const K& key_at(const_iterator) noexcept;
+        static size_t slot_at(const_iterator) noexcept;
+
+    private:
+        keys_t keys;
+        // Sorted by the keys.
+        entries_t entries;
+    };
+
+    // A reference-counted pointer like std::shared_ptr, whose count
+    // is a plain integer stored together with the object, so that
+    // copying the pointer needs no atomic instructions. Hence copies
+    // must not be used from different threads at once.
+    template <class T>
+    class local_ptr {
+    public:
+        local_ptr() noexcept;
+        local_ptr(std::nullptr_t) noexcept;
+        local_ptr(const local_ptr&) noexcept;
+        local_ptr(local_ptr&&) noexcept;
+        ~local_ptr();
+
+        local_ptr& operator=(local_ptr) noexcept;
+
+        // Constructs a T owned by a new pointer.
+        template <class... Args>
+        static local_ptr make(Args&&...);
+
+        T& operator*() const noexcept;
+        T* operator->() const noexcept;
+        long use_count() const noexcept;
+
+        bool operator==(const local_ptr&) const noexcept = default;
+
+    private:
+        struct block_t {
+            T value;
+            long count;
+            template <class... Args>
+            block_t(Args&&...);
+        };
+        block_t* block;
+
+        explicit local_ptr(block_t*) noexcept;
+    };
+
+    // Counters of the events that determine a stack's performance.
+    struct stack_stats {
+        size_t deep_copies = 0;
+        // The number of elements copied by the deep copies.
+        size_t deep_copied_elements = 0;
+        std::chrono::nanoseconds deep_copy_time{0};
+        size_t shared_copies = 0;
+        // Shared or sharable stacks made unsharable by a non-const front.
+        size_t unsharable_transitions = 0;
+        // Key index lookups (including insertions).
+        size_t lookups = 0;
+        // Blocks handed out by the node arenas, and the requests
+        // made by the arenas to the policy's allocator.
+        size_t allocations = 0;
+        size_t upstream_allocations = 0;
+        // Thrown std::invalid_argument exceptions.
+        size_t invalid_arguments = 0;
+    };
+
+    // The memory held by a stack's data, in bytes. Only memory from the
+    // policy's allocator (and the data structures themselves) is counted,
+    // not what the keys and values allocate on their own.
+    struct stack_memory {
+        // The payload: the live values, and the keys (each stored once).
+        size_t values = 0;
+        size_t keys = 0;
+        // The rest of the memory in use: the links of the elements, the
+        // stack order, the nodes of the key index, the spare capacity of
+        // the arrays and the data structures themselves.
+        size_t overhead = 0;
+        // Memory obtained from the allocator and not in use (e.g. that
+        // of popped elements), which later pushes recycle.
+        size_t free = 0;
+        // The same total, split by whether the memory is shared with
+        // other stacks: the data with copies of the stack, or just the
+        // key index with deep copies.
+        size_t shared = 0;
+        size_t exclusive = 0;
+
+        size_t total() const noexcept;
+    };
+
+    // Statistics policies are notified of the events counted by
+    // stack_stats. The statistics of a stack are kept with its data,
+    // and a deep copy starts with the statistics of its original.
+    //
+    // The default, which ignores every event and takes no space.
+    struct no_stats {
+        static constexpr bool enabled = false;
+
+        void deep_copy(size_t, std::chrono::nanoseconds) noexcept {}
+        void shared_copy() noexcept {}
+        void unsharable_transition() noexcept {}
+        void lookup() noexcept {}
+        void allocation() noexcept {}
+        void upstream_allocation() noexcept {}
+        void invalid_argument() noexcept {}
+    };
+
+    // Counts the events of every stack, and of the whole process.
+    // The process-wide counters are atomic, the per-stack ones aren't.
+    class counting_stats {
+    public:
+        static constexpr bool enabled = true;
+
+        void deep_copy(size_t, std::chrono::nanoseconds) noexcept;
+        void shared_copy() noexcept;
+        void unsharable_transition() noexcept;
+        void lookup() noexcept;
+        void allocation() noexcept;
+        void upstream_allocation() noexcept;
+        void invalid_argument() noexcept;
+
+        const stack_stats& snapshot() const noexcept;
+        // The events of all the stacks using counting_stats.
+        static stack_stats global_snapshot() noexcept;
+
+    private:
+        using counter_t = std::atomic<size_t>;
+
+        stack_stats local;
+
+        static inline counter_t deep_copies{0};
+        static inline counter_t deep_copied_elements{0};
+        static inline std::atomic<std::chrono::nanoseconds::rep> deep_copy_time{0};
+        static inline counter_t shared_copies{0};
+        static inline counter_t unsharable_transitions{0};
+        static inline counter_t lookups{0};
+        static inline counter_t allocations{0};
+        static inline counter_t upstream_allocations{0};
+        static inline counter_t invalid_arguments{0};
+
+        static void add(counter_t&, size_t = 1) noexcept;
+    };
+
+    // Reclaimers destroy the data that a stack drops (when it is
+    // destroyed, assigned to or cleared) and nobody else shares.
+    //
+    // The default, which destroys it right away.
+    struct inline_reclaimer {
+        static constexpr bool deferred = false;
+
+        template <class T>
+        static void retire(T) noexcept {}
+    };
+
+    // Hands the data to a background thread, so that dropping a stack
+    // takes O(1) time however many elements it has. The thread is
+    // started by the first retire and stopped at exit. The policy's
+    // allocator (and the destructors of K and V) must then be safe
+    // to call from that thread. Only what nobody else shares is
+    // retired, so the reference counts (even those of local_ptr)
+    // are never changed by the thread.
+    class background_reclaimer {
+    public:
+        static constexpr bool deferred = true;
+
+        // Takes the object over. If it can't be queued, or the thread
+        // has already stopped, the object is destroyed right away.
+        template <class T>
+        static void retire(T) noexcept;
+        // Waits until everything retired so far has been destroyed.
+        static void drain();
+
+    private:
+        struct retired_t {
+            retired_t* next = nullptr;
+            virtual ~retired_t() = default;
+        };
+        template <class T>
+        struct holder_t : retired_t {
+            T object;
+            explicit holder_t(T&&) noexcept;
+        };
+        class worker_t;
+
+        static inline std::atomic<bool> stopped{false};
+
+        // The running worker, or nullptr once it has stopped.
+        static worker_t* worker();
+    };
+
+    class background_reclaimer::worker_t {
+    public:
+        worker_t();
+        worker_t(const worker_t&) = delete;
+        worker_t& operator=(const worker_t&) = delete;
+        // Destroys what is still queued.
+        ~worker_t();
+
+        void push(retired_t*);
+        void drain();
+
+    private:
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        // The retired objects, most recent first.
+        retired_t* queue;
+        uint64_t pushed;
+        uint64_t destroyed;
+        bool stopping;
+        std::thread thread;
+
+        void run();
+    };
+
+    // The binary image of a stack with trivially copyable keys and
+    // values, as written by stack::serialize. It consists of a header,
+    // the keys in increasing order (each with the position of its top
+    // element and its number of elements), and then the elements from
+    // the bottom of the stack up, each with the index of its key. Every
+    // table is aligned for its records, which are in the native layout
+    // and byte order, so that an image can be read in place.
     template <class K, class V>
+    class stack_image {
+    public:
+        struct header_t {
+            char magic[8];
+            std::uint32_t key_size;
+            std::uint32_t value_size;
+            std::uint64_t keys;
+            std::uint64_t elements;
+        };
+        struct key_t {
+            K key;
+            std::uint32_t top;
+            std::uint32_t count;
+        };
+        struct element_t {
+            V value;
+            std::uint32_t key;
+        };
+
+        static constexpr char magic[8] = {'c', 'x', 'x', 's', 't', 'a', 'c', 'k'};
+
+        // The size of an image with the given numbers of keys and elements.
+        static size_t size(size_t, size_t) noexcept;
+
+        // Checks the header and bounds of the image, whose memory must
+        // outlive this object. Throws std::invalid_argument if the image
+        // is malformed (or misaligned). The records aren't checked.
+        explicit stack_image(std::span<const std::byte>);
+
+        std::span<const key_t> keys() const noexcept;
+        std::span<const element_t> elements() const noexcept;
+        // The key record of the given key, or nullptr.
+        const key_t* find(const K&) const;
+
+        // Writers of the parts of an image, which must be called in order.
+        static void write_header(std::ostream&, size_t, size_t);
+        static void write_key(std::ostream&, const K&, size_t, size_t);
+        // Pads the key table, before the first element.
+        static void write_gap(std::ostream&, size_t);
+        static void write_element(std::ostream&, const V&, size_t);
+
+        [[noreturn]] static void malformed();
+
+    private:
+        std::span<const key_t> key_records;
+        std::span<const element_t> element_records;
+
+        static size_t keys_offset() noexcept;
+        static size_t elements_offset(size_t) noexcept;
+        template <class T, class... Fields>
+        static void write_record(std::ostream&, const Fields&...);
+        static void write_padding(std::ostream&, size_t);
+    };
+
+    // The default stack policy. A custom policy can be
+    // supplied as the third template argument of stack.
+    struct stack_policy {
+        // The allocator from which each stack_data's node
+        // arena obtains its slabs.
+        template <class T>
+        using allocator = std::allocator<T>;
+        // The index of the keys, one of ordered_index, hash_index
+        // and flat_index (or a compatible class template).
+        template <class Key, class Alloc>
+        using key_index = ordered_index<Key, Alloc>;
+        // The pointer through which copies share their data,
+        // std::shared_ptr or local_ptr (for stacks whose copies
+        // all stay on one thread), or a class template with the
+        // interface of local_ptr.
+        template <class T>
+        using data_ptr = std::shared_ptr<T>;
+        // The statistics kept for each stack, no_stats or
+        // counting_stats.
+        using stats = no_stats;
+        // What destroys dropped data, inline_reclaimer or
+        // background_reclaimer.
+        using reclaimer = inline_reclaimer;
+        // The number of elements from which a deep copy copies the
+        // values on several threads (one per hardware thread), or 0
+        // to always copy them on the calling thread.
+        static constexpr size_t parallel_copy = 0;
+    };
+
+    template <class K, class V, class Policy = stack_policy>
     class stack {
     public:
         stack();
         stack(const stack&);
         stack(stack&&) noexcept;
+        // Leaves the data to the policy's reclaimer.
+        ~stack();
 
         stack& operator=(stack) noexcept;
 
         void push(const K&, const V&);
+        void push(const K&, V&&);
+        void push(K&&, V&&);
+        // Constructs the value in place from the given arguments.
+        template <class... Args>
+        void emplace(const K&, Args&&...);
         void pop();
         void pop(const K&);
+        // Pushes the (key, value) pairs from [first, last), in order.
+        template <class InputIt>
+        void push_range(InputIt, InputIt);
+        // Pops the n topmost elements.
+        void pop_n(size_t);
+        // Pops every element with the given key.
+        void pop_all(const K&);
+        // Like pop, but return false instead of throwing
+        // std::invalid_argument if there is nothing to pop.
+        bool try_pop();
+        bool try_pop(const K&);
+        // Pops the front element and returns its value, which is
+        // moved out if that can't throw and the data isn't shared.
+        V extract();
+        // Pushes the elements of other on top, in their order, and
+        // leaves other empty. Values are moved as by extract.
+        void splice_on_top(stack&&);
+        // Pops the elements whose keys are in [first, last) (as
+        // ordered by <) and returns them as a stack, in their order.
+        stack extract_keys(const K&, const K&);
+        // Pop the bottom element (with the given key).
+        void pop_bottom();
+        void pop_bottom(const K&);
+        // Bounds the stack to max_size elements, and to max_per_key
+        // elements with each key (0 means no bound). A push past a
+        // bound evicts the bottom elements with the pushed keys, and
+        // then the bottom ones, as needed. Elements past the new bounds
+        // are evicted right away. Copies of the stack keep its bounds.
+        void set_bounds(size_t, size_t = 0);
+        // The bounds given to set_bounds, (0, 0) by default.
+        std::pair<size_t, size_t> bounds() const noexcept;
 
         std::pair<const K&, V&> front();
         std::pair<const K&, const V&> front() const;
         V& front(const K&);
         const V& front(const K&) const;
+        // Like front, but return nothing instead of throwing
+        // std::invalid_argument if there is no such element.
+        std::optional<std::pair<const K&, V&>> try_front();
+        std::optional<std::pair<const K&, const V&>> try_front() const;
+        V* try_front(const K&);
+        const V* try_front(const K&) const;
+
+        // Scoped mutable access. Unlike the non-const front methods,
+        // these don't make the stack permanently unsharable: copies
+        // are deep only while a guard is alive. The stack must not be
+        // copied into, swapped or moved while it has a live guard.
+        class front_guard;
+        front_guard modify_front();
+        front_guard modify_front(const K&);
+        // Call f(const K&, V&) on the front element(s) and return its
+        // result. Changes made by f before it throws are kept.
+        template <class F>
+        decltype(auto) update_front(F&&);
+        template <class F>
+        decltype(auto) update_front(const K&, F&&);
 
         size_t size() const noexcept;
         size_t count(const K&) const;
 
+        // Makes room for the given total numbers of elements and keys,
+        // so that pushing them doesn't reallocate the stack's arrays.
+        // Shared data is detached straight into a copy of that size.
+        void reserve(size_t, size_t = 0);
+        // The number of elements the stack can hold before
+        // its arrays have to grow.
+        size_t capacity() const noexcept;
+        // Releases the unused capacity of the arrays, unless the data
+        // is shared. Memory of popped nodes stays in the arena.
+        void shrink_to_fit();
+
+        // Refers to a key, so that keyed operations on it don't have to
+        // look it up again. A handle stays valid, also in the copies of
+        // the stack, as long as the key has elements.
+        class key_handle;
+        // An empty handle if there is no such key. With a transparent
+        // key index, Q can be any type comparable with K.
+        template <class Q>
+        key_handle find(const Q&) const;
+        // As their K counterparts. Empty handles make them throw
+        // std::invalid_argument. Invalidated ones must not be used.
+        size_t count(key_handle) const noexcept;
+        V& front(key_handle);
+        const V& front(key_handle) const;
+        void pop(key_handle);
+
         void clear();
 
         class const_iterator;
-        const_iterator cbegin() const noexcept;
-        const_iterator cend() const noexcept;
+        // Only throw if the key index's begin (end) does, as that of
+        // hash_index does when it sorts the keys.
+        const_iterator cbegin() const
+                noexcept(noexcept(std::declval<const typename stack_data::map_t&>().begin()));
+        const_iterator cend() const
+                noexcept(noexcept(std::declval<const typename stack_data::map_t&>().end()));
+        // The first key not less than (greater than) k, and both. With
+        // a transparent key index, Q can be any type comparable with K.
+        template <class Q>
+        const_iterator lower_bound(const Q&) const;
+        template <class Q>
+        const_iterator upper_bound(const Q&) const;
+        template <class Q>
+        std::pair<const_iterator, const_iterator> equal_range(const Q&) const;
+        // The number of keys less than k, and the key with the given
+        // number of smaller keys. They take O(log n) time with
+        // flat_index, but O(n) with ordered_index, whose iterators
+        // have to walk the tree. hash_index takes O(log n) time too,
+        // except when its keys have to be sorted (after the key set
+        // has changed), which takes O(n log n).
+        template <class Q>
+        size_t rank(const Q&) const;
+        const K& nth_key(size_t) const;
+
+        // Read-only views of the elements, which don't copy (or detach)
+        // the data. Any modification of the stack invalidates them.
+        class element_iterator;
+        class value_iterator;
+        // The (key, value) pairs from the top to the bottom, as a
+        // std::ranges::subrange of element_iterators. Reverse it
+        // (e.g. with std::views::reverse) for the push order.
+        auto elements() const noexcept;
+        // The values with the given key, from the top down,
+        // as a subrange of value_iterators.
+        auto values(const K&) const;
+
+        using stats_t = typename Policy::stats;
+        // The statistics of this stack (and the copies it shares
+        // its data with).
+        const stats_t& stats() const noexcept;
+        // The memory held by the stack (see stack_memory), in O(1) time.
+        stack_memory memory_usage() const noexcept;
+
+        // Writes the binary image of the stack (see stack_image), which
+        // deserialize turns back into a stack in O(n) time (plus the
+        // time of inserting the keys into the index). Stream errors are
+        // reported by the stream's state.
+        void serialize(std::ostream&) const
+                requires std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>;
+        // Throw std::invalid_argument if the image is malformed.
+        static stack deserialize(std::istream&)
+                requires std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>;
+        static stack deserialize(std::span<const std::byte>)
+                requires std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>;
 
     private:
+        class node_arena;
+        template <class T>
+        class arena_allocator;
         class stack_data;
-        std::shared_ptr<stack_data> data;
+        using data_ptr_t = typename Policy::template data_ptr<stack_data>;
+        data_ptr_t data;
         bool is_unsharable;
+        // The number of live front_guards.
+        size_t guards;
+        // See set_bounds.
+        size_t size_bound;
+        size_t key_bound;
+
+        // Hands data nobody else shares to the policy's reclaimer,
+        // and otherwise just drops it. A key table still shared with
+        // deep copies is dropped here, without the data.
+        static void retire(data_ptr_t) noexcept;
 
         // Normally, we'd make this a free function,
         // but there is no mention of swap in the specification,
         // so we have to leave it hidden.
         void swap(stack&, stack&) noexcept;
 
-        using new_state_t = std::pair<std::shared_ptr<stack_data>, bool>;
-        
+        using new_state_t = std::pair<data_ptr_t, bool>;
+
+        template <class... Args>
+        static data_ptr_t make_data(Args&&...);
+        // A deep copy of the data (with args as for stack_data's
+        // constructors), recorded in the statistics.
+        template <class... Args>
+        data_ptr_t copy_data(Args&&...) const;
+
         stack_data& get_data() const noexcept;
         stack_data& get_data(const new_state_t&) const noexcept;
         void assume_state(const new_state_t&) noexcept;
 
         new_state_t make_copy_if_needed(bool) const;
+        // Calls push(stack_data&) on a copy if needed, and then
+        // evicts what is past the bounds.
+        template <class F>
+        void push_bounded(F&&);
+        // Like make_copy_if_needed(false), but the copy leaves out the
+        // elements in the slots returned by removed(get_data()), as if
+        // they had been popped in that order.
+        template <class F>
+        new_state_t make_copy_without(F&&) const;
     };
 
-    template<class K, class V>
-    class stack<K, V>::stack_data {
+    // The elements are kept in a chunked array of slots. The stack
+    // order is a contiguous array of slot indices, and elements with
+    // the same key are chained through indices as well, so front()
+    // and pop() only follow a few array lookups and a copy doesn't
+    // have to relink any element.
+    //
+    // If K and V are trivially copyable, the storage is compact: the
+    // slots are plain elements in a contiguous array, indices take 32
+    // bits, and copying or clearing the arrays is a memcpy or O(1).
+    // Then a push may move the elements, though.
+    template <class K, class V, class Policy>
+    class stack<K, V, Policy>::stack_data {
     public:
         // Types.
-        struct element_t;
-        struct value_data_t;
-        using value_list_t = std::list<element_t>;
-        using map_t = std::map<K, std::shared_ptr<value_data_t>>;
-        using stack_list_t = std::list<std::weak_ptr<value_data_t>>;
+        static constexpr bool compact_storage =
+                std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V>;
+        using index_t = std::conditional_t<compact_storage, std::uint32_t, size_t>;
+        // Marks the absence of an element (e.g. a removed position).
+        static constexpr index_t npos = static_cast<index_t>(-1);
+        // Leaves room for the holes in the stack order.
+        static constexpr size_t max_size = npos / 2;
+        template <class T>
+        using allocator_t = arena_allocator<T>;
+        // Maps each key to its key slot.
+        using map_t = typename Policy::template key_index<K, allocator_t<std::byte>>;
+        struct key_slot_t {
+            map_t::handle_t entry;
+            // The topmost and bottommost elements with this key.
+            index_t top;
+            index_t bottom;
+            index_t count;
+        };
         struct element_t {
             V value;
-            // List iterators are stable.
-            stack_list_t::iterator it;
-            element_t() = default;
-            element_t(const V&, stack_list_t::iterator);
-        };
-        struct value_data_t {
-            value_list_t list;
-            // Map iterators are stable.
-            map_t::iterator it;
+            // Elements refer to keys by their key slot, which is
+            // the same in every copy.
+            index_t key;
+            // The elements right below and right above with the same
+            // key (below is npos at the bottom). Pops leave the link
+            // above the new topmost element as it was, so it is only
+            // followed from below the top, e.g. by evictions.
+            index_t below;
+            index_t above;
+            // The position in the stack order.
+            index_t pos;
+            template <class... Args>
+            element_t(index_t, index_t, index_t, Args&&...);
         };
+        // Compact slots of popped elements just aren't read.
+        using slot_t = std::conditional_t<compact_storage, element_t, std::optional<element_t>>;
+        using slots_t = std::conditional_t<compact_storage,
+                std::vector<slot_t, allocator_t<slot_t>>,
+                std::deque<slot_t, allocator_t<slot_t>>>;
+        using key_slots_t = std::vector<key_slot_t, allocator_t<key_slot_t>>;
+        using indices_t = std::vector<index_t, allocator_t<index_t>>;
+        class key_table;
+        using key_table_ptr = typename Policy::template data_ptr<key_table>;
 
         // Member variables.
-        stack_list_t stack_list;
-        map_t key_map;
+        // The arena must outlive every container allocating from it,
+        // hence it is declared (and so destroyed) first.
+        node_arena arena;
+        // Slot indices are stable, and unless the storage
+        // is compact, the elements never move.
+        slots_t slots;
+        // Slot lists always have the capacity for all the slots,
+        // so that freeing a slot doesn't throw.
+        indices_t free_slots;
+        key_slots_t key_slots;
+        indices_t free_key_slots;
+        // Slot indices from the bottom to the top of the stack.
+        // Removed positions hold npos, but the top never does.
+        indices_t order;
+        size_t holes;
+        // The positions below it are all holes, so that finding
+        // the bottom element doesn't scan them again.
+        size_t bottom;
+        // The deep copies of the data share their key table for as
+        // long as none of them changes its set of keys (see own_keys).
+        key_table_ptr table;
+        // The front element, updated by every operation that may
+        // change or move it, so that front() doesn't have to follow
+        // the indices. Null if the stack is empty.
+        const K* top_key;
+        V* top_value;
 
         // Member methods.
         stack_data();
-        stack_data(stack_data&&) noexcept;
+        // The containers are bound to the arena, so stack_data
+        // can't be moved.
+        stack_data(stack_data&&) = delete;
         stack_data(const stack_data&);
-
-        void push(const K&, const V&);
+        // Copies other with room for the given total numbers
+        // of elements and keys.
+        stack_data(const stack_data&, size_t, size_t);
+        // Loads the image (checking its records).
+        explicit stack_data(const stack_image<K, V>&);
+        // Copies other without the elements in the given slots, as if
+        // they had been popped in that order (so each one must be the
+        // topmost with its key by then). Their values aren't copied.
+        stack_data(const stack_data&, const std::vector<index_t>&);
+
+        // The value is constructed in place from args.
+        template <class KeyArg, class... Args>
+        void emplace(KeyArg&&, Args&&...);
         void pop();
         void pop(const K&);
+        template <class InputIt>
+        void push_range(InputIt, InputIt);
+        void pop_n(size_t);
+        void pop_all(const K&);
+        // Pops the element in the slot, the topmost with its key.
+        // detach_keys(slot) must be called first.
+        void pop_slot(index_t) noexcept;
+        // Pop the bottom element (with the given key). Unless there is
+        // no such element, they only throw if the key table is shared.
+        void pop_bottom();
+        void pop_bottom(const K&);
+        // Pops the bottom elements with the keys of the elements in the
+        // n topmost positions until each has at most max_per_key, and then
+        // the bottom elements until there are at most max_size (0 means
+        // no bound). own_keys() must have been called first.
+        void evict(size_t, size_t, size_t) noexcept;
+        // Makes the key table this data's own if removing the element
+        // in the slot (the topmost with its key) would remove its key.
+        void detach_keys(index_t);
+        // Unless it is this data's own already, replaces the key table
+        // by a copy with room for the given total number of keys, so
+        // that keys can be inserted and erased (strong guarantee).
+        void own_keys(size_t = 0);
+        // Pushes the elements in the given slots of other, in that
+        // order. If steal is set and V's move constructor is noexcept,
+        // their values are moved, and moved back if a push fails.
+        void push_from(stack_data&, const std::vector<index_t>&, bool);
+        // Pops the elements in the given slots, which are ordered from
+        // the bottom up. own_keys() must have been called first.
+        void erase(const std::vector<index_t>&) noexcept;
+        // Makes room for n more elements (but not their keys).
+        void reserve_for(size_t);
+        // Makes room for the given total numbers of elements and keys.
+        void reserve(size_t, size_t);
+        void shrink_to_fit();
+        size_t capacity() noexcept;
+
+        // The slots of the front elements. They throw
+        // std::invalid_argument (naming the calling method)
+        // if there is no such element.
+        index_t top_slot(const char*);
+        index_t top_slot(const K&, const char*);
+        // The topmost slot with the key in the given key slot.
+        index_t key_top_slot(size_t, const char*);
+        // The n topmost slots, from the top down.
+        std::vector<index_t> top_slots(size_t);
+        // The slots with the given key, from the top down.
+        std::vector<index_t> key_chain(const K&, const char*);
+        // The slots with keys in [first, last), from the bottom up.
+        std::vector<index_t> key_range(const K&, const K&);
 
         // Const V members are not needed as stack_data
         // is never const and so the stack methods
         // can perform the appropriate conversion.
         std::pair<const K&, V&> front();
-        V& front(const K&);
-
-        void clear() noexcept;
+        std::pair<const K&, V&> front(const K&);
+        // Nothing if there is no such element.
+        std::optional<std::pair<const K&, V&>> try_front(const K&);
+        V& value(index_t) noexcept;
+        std::pair<const K&, V&> entry(index_t) noexcept;
+        // The slot of the element right below with the same key.
+        index_t below(index_t) noexcept;
+
+        // Only throws if the key table is shared.
+        void clear();
         size_t size() noexcept;
+        size_t key_count() const noexcept;
+        map_t& key_map() const noexcept;
+
+        // Counts the data as shared if shared is set.
+        stack_memory memory_usage(bool) const noexcept;
+
+        // Writes the image of the data.
+        void serialize(std::ostream&);
+
+        // Throws std::invalid_argument, recording it in the statistics.
+        [[noreturn]] void reject(const std::string&);
+
+    private:
+        element_t& element(index_t) noexcept;
+        static const element_t& element(const slot_t&) noexcept;
+        key_slot_t& key_slot(const element_t&) noexcept;
+        // Constructs the element in the given slot, which is either
+        // free or the next one (the array then grows).
+        template <class... Args>
+        void construct(index_t, Args&&...);
+        // Removes the topmost element with its key.
+        void remove(index_t) noexcept;
+        // Unlinks the element in the given slot, leaving
+        // the slot itself (and the stack order) intact.
+        void unlink(const element_t&, index_t) noexcept;
+        // Removes the position of an unlinked element.
+        void erase_position(index_t) noexcept;
+        // The slot of the bottom element, if there is one.
+        index_t bottom_slot() noexcept;
+        // Removes the element in the slot, the bottom one with its
+        // key, leaving a hole in its position.
+        void remove_bottom(index_t) noexcept;
+        // Removes the bottom element with the key in the key slot,
+        // which has more than one element, leaving a hole.
+        void remove_key_bottom(index_t) noexcept;
+        // Whether popping every element from the given position
+        // up would remove a key.
+        bool removes_key(size_t) noexcept;
+        void release_key(index_t) noexcept;
+        void trim() noexcept;
+        void compact() noexcept;
+        void refresh_top() noexcept;
+        // How many elements (keys) short of the given number there are.
+        size_t room(size_t) const noexcept;
+        size_t key_room(size_t) const noexcept;
+        template <class Vector>
+        static void grow(Vector&, size_t);
+        // A copy of the container, with (at least) the given capacity
+        // if it has one.
+        template <class Container>
+        static Container copy_of(const Container&, size_t, const typename Container::allocator_type&);
+        // A copy of the slots with (at least) the given capacity, in
+        // which the given slots are left empty unless the storage is
+        // compact. Big copies are made in parallel (see stack_policy).
+        static slots_t copy_slots(const slots_t&, size_t, const std::vector<index_t>&,
+                                  const allocator_t<slot_t>&);
+        // Roughly the arena memory taken by the nodes of new keys.
+        static size_t key_bytes(size_t) noexcept;
+        template <class... Args>
+        static key_table_ptr make_table(Args&&...);
     };
 
-    // A wrapper for the map's const iterator.
-    template<class K, class V>
-    class stack<K, V>::const_iterator {
-        using map_t_it = stack_data::map_t::const_iterator;
+    // The key index, with an arena of its own so that it can
+    // outlive the data that created it. Each key is stored once,
+    // in its index node, together with its key slot.
+    template <class K, class V, class Policy>
+    class stack<K, V, Policy>::stack_data::key_table {
+    public:
+        node_arena arena;
+        map_t map;
+
+        // With room for the given number of keys.
+        explicit key_table(size_t = 0);
+        // Copies other with room for the given total number of keys.
+        key_table(const key_table&, size_t);
+    };
+
+    // A per-stack_data memory arena. Blocks are carved out of
+    // slabs obtained from the policy's allocator, and deallocated
+    // blocks are kept on per-size free lists, so that popping
+    // recycles nodes instead of returning them to the allocator.
+    template <class K, class V, class Policy>
+    class stack<K, V, Policy>::node_arena {
+    public:
+        // The first slab is at least initial_capacity bytes large,
+        // so that e.g. the small blocks of a deep copy share one slab.
+        explicit node_arena(size_t initial_capacity = 0, const stats_t& = stats_t()) noexcept;
+        node_arena(const node_arena&) = delete;
+        node_arena& operator=(const node_arena&) = delete;
+        ~node_arena();
+
+        void* allocate(size_t, size_t);
+        void deallocate(void*, size_t, size_t) noexcept;
+
+        // The number of bytes currently handed out, and obtained
+        // from the allocator (including the free ones).
+        size_t bytes_in_use() const noexcept;
+        size_t bytes_obtained() const noexcept;
+        // The bytes in use that were carved out of the slabs, which
+        // is what a copy's first slab has to hold.
+        size_t bytes_pooled() const noexcept;
+        // Makes sure that the next size bytes of
+        // small blocks come from a single slab.
+        void reserve(size_t);
+
+        // The statistics of the stack_data, kept here since
+        // this is where the allocations are counted.
+        [[no_unique_address]] stats_t stats;
+
+    private:
+        using unit_t = std::max_align_t;
+        using upstream_t = typename Policy::template allocator<unit_t>;
+
+        struct block_t {
+            block_t* next;
+        };
+        struct slab_t {
+            slab_t* next;
+            size_t units;
+        };
+
+        static constexpr size_t unit_size = sizeof(unit_t);
+        // Larger (or over-aligned) blocks bypass the arena.
+        static constexpr size_t max_pooled_units = 32;
+        static constexpr size_t min_slab_units = 256;
+        static constexpr size_t header_units = (sizeof(slab_t) + unit_size - 1) / unit_size;
+
+        upstream_t upstream;
+        block_t* free_lists[max_pooled_units];
+        slab_t* slabs;
+        unit_t* cursor;
+        unit_t* limit;
+        size_t next_slab_units;
+        size_t in_use;
+        size_t obtained;
+        // Of in_use, the bytes of the blocks that bypass the arena.
+        size_t large;
+
+        static size_t units_for(size_t) noexcept;
+        void add_slab(size_t);
+    };
+
+    // A minimal allocator forwarding to a node_arena.
+    template <class K, class V, class Policy>
+    template <class T>
+    class stack<K, V, Policy>::arena_allocator {
+    public:
+        using value_type = T;
+        template <class U>
+        struct rebind {
+            using other = arena_allocator<U>;
+        };
+
+        explicit arena_allocator(node_arena&) noexcept;
+        template <class U>
+        arena_allocator(const arena_allocator<U>&) noexcept;
+
+        T* allocate(size_t);
+        void deallocate(T*, size_t) noexcept;
+
+        node_arena& arena() const noexcept;
+
+        template <class U>
+        bool operator==(const arena_allocator<U>&) const noexcept;
+
+    private:
+        node_arena* pool;
+    };
+
+    // Gives mutable access to a value for as long as it is alive.
+    template <class K, class V, class Policy>
+    class stack<K, V, Policy>::front_guard {
+    public:
+        front_guard(const front_guard&) = delete;
+        front_guard(front_guard&&) noexcept;
+        front_guard& operator=(const front_guard&) = delete;
+        front_guard& operator=(front_guard&&) = delete;
+        ~front_guard();
+
+        const K& key() const noexcept;
+        V& value() const noexcept;
+
+    private:
+        stack* owner;
+        const K* key_ptr;
+        V* value_ptr;
+
+        front_guard(stack&, const K&, V&) noexcept;
+
+        friend front_guard stack::modify_front();
+        friend front_guard stack::modify_front(const K&);
+    };
+
+    template <class K, class V, class Policy>
+    class stack<K, V, Policy>::key_handle {
+    public:
+        // An empty handle.
+        key_handle() noexcept;
+
+        explicit operator bool() const noexcept;
+
+    private:
+        friend class stack;
+        static constexpr size_t npos = static_cast<size_t>(-1);
+
+        // Key slots are the same in every copy.
+        size_t key_slot;
+
+        explicit key_handle(size_t) noexcept;
+    };
+
+    // Walks the stack order downwards, skipping the holes.
+    template <class K, class V, class Policy>
+    class stack<K, V, Policy>::element_iterator {
+    public:
+        using iterator_concept = std::bidirectional_iterator_tag;
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::pair<const K&, const V&>;
+        using difference_type = std::ptrdiff_t;
+
+        element_iterator() noexcept;
+
+        element_iterator& operator++() noexcept;
+        element_iterator operator++(int) noexcept;
+        element_iterator& operator--() noexcept;
+        element_iterator operator--(int) noexcept;
+
+        std::pair<const K&, const V&> operator*() const noexcept;
+
+        bool operator==(const element_iterator&) const noexcept;
+
+    private:
+        friend class stack;
+
+        stack_data* data;
+        // One past the position in the stack order, so that
+        // the end (below the bottom) is 0.
+        size_t pos;
+
+        element_iterator(stack_data&, size_t) noexcept;
+    };
+
+    // Follows the values of a key downwards.
+    template <class K, class V, class Policy>
+    class stack<K, V, Policy>::value_iterator {
+        using index_t = stack_data::index_t;
     public:
         using iterator_category = std::forward_iterator_tag;
+        using value_type = V;
+        using difference_type = std::ptrdiff_t;
+
+        value_iterator() noexcept;
+
+        value_iterator& operator++() noexcept;
+        value_iterator operator++(int) noexcept;
+
+        const V& operator*() const noexcept;
+        const V* operator->() const noexcept;
+
+        bool operator==(const value_iterator&) const noexcept;
+
+    private:
+        friend class stack;
+
+        stack_data* data;
+        index_t slot;
+        // The number of values left, including this one.
+        size_t left;
+
+        value_iterator(stack_data&, index_t, size_t) noexcept;
+    };
+
+    // A wrapper for the key index's const iterator.
+    template <class K, class V, class Policy>
+    class stack<K, V, Policy>::const_iterator {
+        using map_t_it = stack_data::map_t::const_iterator;
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
         using value_type = K;
-        using difference_type = map_t_it::difference_type;
+        using difference_type = std::iterator_traits<map_t_it>::difference_type;
 
         const_iterator() = default;
         const_iterator(const const_iterator&) noexcept;
@@ -112,6 +1163,8 @@ namespace cxx {
 
         const_iterator& operator++() noexcept;
         const_iterator operator++(int) noexcept;
+        const_iterator& operator--() noexcept;
+        const_iterator operator--(int) noexcept;
 
         const K& operator*() const;
         const K* operator->() const;
@@ -125,347 +1178,2694 @@ namespace cxx {
         const_iterator(map_t_it) noexcept;
 
         // Can construct the iterator by providing a map_t_it.
-        friend const_iterator stack::cbegin() const noexcept;
-        friend const_iterator stack::cend() const noexcept;
+        friend class stack;
     };
 
 
     // ---------- Implementations ---------- //
-    // -- stack -- //
+    // -- ordered_index -- //
 
-    template <class K, class V>
-    stack<K, V>::stack()
-            : data(std::make_shared<stack_data>())
-            , is_unsharable(false) {}
+    template <class K, class Alloc, class Compare>
+    ordered_index<K, Alloc, Compare>::ordered_index(const Alloc& alloc)
+            : map(alloc) {}
 
-    template <class K, class V>
-    stack<K, V>::stack(stack&& other) noexcept
-            : data(std::move(other.data))
-            , is_unsharable(other.is_unsharable) {}
+    template <class K, class Alloc, class Compare>
+    ordered_index<K, Alloc, Compare>::ordered_index(const ordered_index& other, const Alloc& alloc)
+            : map(other.map, alloc) {}
 
-    template <class K, class V>
-    stack<K, V>::stack(const stack& other)
-            : data(nullptr)
-            , is_unsharable(false) {
-        if (other.is_unsharable) {
-            // Make a deep copy (should the constructor throw,
-            // no memory will be leaked).
-            data = std::make_shared<stack_data>(other.get_data());
-        } else {
-            // Add another reference.
-            data = other.data;
-        }
+    template <class K, class Alloc, class Compare>
+    template <class KeyArg>
+    std::pair<typename ordered_index<K, Alloc, Compare>::handle_t, bool>
+    ordered_index<K, Alloc, Compare>::try_emplace(KeyArg&& key, size_t slot) {
+        return map.try_emplace(std::forward<KeyArg>(key), slot);
     }
 
-    template <class K, class V>
-    stack<K, V>& stack<K, V>::operator=(stack other) noexcept {
-        // Since the stack is a temporary copy,
-        // we can now safely swap our contents.
-        swap(*this, other);
-        return *this;
+    template <class K, class Alloc, class Compare>
+    void ordered_index<K, Alloc, Compare>::erase(handle_t entry) noexcept {
+        map.erase(entry);
     }
 
-    template <class K, class V>
-    void stack<K, V>::push(const K& key, const V& value) {
-        auto new_state = make_copy_if_needed(false);
-        get_data(new_state).push(key, value);
-        assume_state(new_state);
+    template <class K, class Alloc, class Compare>
+    void ordered_index<K, Alloc, Compare>::clear() noexcept {
+        map.clear();
     }
 
-    template <class K, class V>
-    void stack<K, V>::pop() {
-        auto new_state = make_copy_if_needed(false);
-        get_data(new_state).pop();
-        assume_state(new_state);
+    template <class K, class Alloc, class Compare>
+    void ordered_index<K, Alloc, Compare>::reserve(size_t) {
+        // Tree nodes are allocated one by one.
     }
 
-    template <class K, class V>
-    void stack<K, V>::pop(const K& k) {
-        auto new_state = make_copy_if_needed(false);
-        get_data(new_state).pop(k);
-        assume_state(new_state);
+    template <class K, class Alloc, class Compare>
+    template <class Q>
+    size_t ordered_index<K, Alloc, Compare>::find(const Q& key) const {
+        auto it = map.find(key);
+        return it == map.end() ? npos : it->second;
     }
 
-    template <class K, class V>
-    std::pair<const K&, V&> stack<K, V>::front() {
-        assume_state(make_copy_if_needed(true));
-        return get_data().front();
+    template <class K, class Alloc, class Compare>
+    const K& ordered_index<K, Alloc, Compare>::key(handle_t entry) const noexcept {
+        return entry->first;
     }
 
-    template <class K, class V>
-    std::pair<const K&, const V&> stack<K, V>::front() const {
-        return get_data().front();
+    template <class K, class Alloc, class Compare>
+    size_t ordered_index<K, Alloc, Compare>::slot(handle_t entry) const noexcept {
+        return entry->second;
     }
 
-    template <class K, class V>
-    V& stack<K, V>::front(const K& k) {
-        assume_state(make_copy_if_needed(true));
-        return get_data().front(k);
+    template <class K, class Alloc, class Compare>
+    template <class F>
+    void ordered_index<K, Alloc, Compare>::for_each(F&& f) {
+        for (auto it = map.begin(); it != map.end(); ++it)
+            f(it, it->second);
     }
 
-    template <class K, class V>
-    const V& stack<K, V>::front(const K& k) const {
-        return get_data().front(k);
+    template <class K, class Alloc, class Compare>
+    ordered_index<K, Alloc, Compare>::const_iterator ordered_index<K, Alloc, Compare>::begin() const noexcept {
+        return map.cbegin();
     }
 
-    template <class K, class V>
-    size_t stack<K, V>::size() const noexcept {
-        return get_data().size();
+    template <class K, class Alloc, class Compare>
+    ordered_index<K, Alloc, Compare>::const_iterator ordered_index<K, Alloc, Compare>::end() const noexcept {
+        return map.cend();
     }
 
-    template <class K, class V>
-    size_t stack<K, V>::count(const K& key) const {
-        const auto& res = get_data().key_map.find(key);
+    template <class K, class Alloc, class Compare>
+    template <class Q>
+    ordered_index<K, Alloc, Compare>::const_iterator
+    ordered_index<K, Alloc, Compare>::lower_bound(const Q& key) const {
+        return map.lower_bound(key);
+    }
 
-        if (res == get_data().key_map.end()) return 0;
-        // Return the size of the corresponding value list.
-        return res->second->list.size();
+    template <class K, class Alloc, class Compare>
+    template <class Q>
+    ordered_index<K, Alloc, Compare>::const_iterator
+    ordered_index<K, Alloc, Compare>::upper_bound(const Q& key) const {
+        return map.upper_bound(key);
     }
 
-    template <class K, class V>
-    void stack<K, V>::clear() {
-        if (data.use_count() > 1) {
-            // Release the resource and create a new empty one.
-            data = std::make_shared<stack_data>();
-        } else {
-            get_data().clear();
-        }
-        is_unsharable = false;
+    template <class K, class Alloc, class Compare>
+    const K& ordered_index<K, Alloc, Compare>::key_at(const_iterator it) noexcept {
+        return it->first;
     }
 
-    template <class K, class V>
-    stack<K, V>::const_iterator stack<K, V>::cbegin() const noexcept {
-        return const_iterator(get_data().key_map.cbegin());
+    template <class K, class Alloc, class Compare>
+    size_t ordered_index<K, Alloc, Compare>::slot_at(const_iterator it) noexcept {
+        return it->second;
     }
 
-    template <class K, class V>
-    stack<K, V>::const_iterator stack<K, V>::cend() const noexcept {
-        return const_iterator(get_data().key_map.cend());
+    // -- hash_index -- //
+
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    hash_index<K, Alloc, Hash, KeyEqual>::hash_index(const Alloc& alloc)
+            : map(alloc)
+            , view(alloc)
+            , view_valid(true)
+            , sorting() {}
+
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    hash_index<K, Alloc, Hash, KeyEqual>::hash_index(const hash_index& other, const Alloc& alloc)
+            : map(other.map, alloc)
+            , view(alloc)
+            , view_valid(false)
+            , sorting() {
+        view.reserve(map.size());
     }
 
-    template <class K, class V>
-    void stack<K, V>::swap(stack& a, stack& b) noexcept {
-        // This swap omits the need for move assignment
-        // in stack<K, V>.
-        std::swap(a.data, b.data);
-        std::swap(a.is_unsharable, b.is_unsharable);
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    template <class KeyArg>
+    std::pair<typename hash_index<K, Alloc, Hash, KeyEqual>::handle_t, bool>
+    hash_index<K, Alloc, Hash, KeyEqual>::try_emplace(KeyArg&& key, size_t slot) {
+        // A present key leaves the view (which may be shared) alone.
+        if (auto it = map.find(key); it != map.end()) return {&*it, false};
+
+        if (view.capacity() < map.size() + 1)
+            view.reserve(std::max(map.size() + 1, view.capacity() * 2));
+        auto it = map.try_emplace(std::forward<KeyArg>(key), slot).first;
+        view_valid.store(false, std::memory_order_relaxed);
+        return {&*it, true};
     }
 
-    template <class K, class V>
-    stack<K, V>::stack_data& stack<K, V>::get_data() const noexcept {
-        return *data;
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    void hash_index<K, Alloc, Hash, KeyEqual>::erase(handle_t entry) noexcept {
+        map.erase(map.find(entry->first));
+        view_valid.store(false, std::memory_order_relaxed);
     }
 
-    template <class K, class V>
-    stack<K, V>::stack_data&
-    stack<K, V>::get_data(const new_state_t& state) const noexcept {
-        return *state.first;
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    void hash_index<K, Alloc, Hash, KeyEqual>::clear() noexcept {
+        map.clear();
+        view.clear();
+        view_valid.store(true, std::memory_order_relaxed);
     }
 
-    template <class K, class V>
-    void stack<K, V>::assume_state(const new_state_t& state) noexcept {
-        std::tie(data, is_unsharable) = state;
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    void hash_index<K, Alloc, Hash, KeyEqual>::reserve(size_t n) {
+        view.reserve(n);
+        // Rehashing moves no nodes, so the handles stay valid.
+        map.reserve(n);
     }
 
-    template <class K, class V>
-    stack<K, V>::new_state_t
-    stack<K, V>::make_copy_if_needed(bool mark_unshared) const {
-        if (data.use_count() > 1) {
-            return {std::make_shared<stack_data>(get_data()), mark_unshared};
-        }
-        // The problem specification states that we
-        // must *always* assume mark_unshared, even if
-        // we run at risk of having a rogue reference
-        // to multiple data instances (it's the user's
-        // responsibility not to use such reference).
-        return {data, mark_unshared};
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    template <class Q>
+    size_t hash_index<K, Alloc, Hash, KeyEqual>::find(const Q& key) const {
+        auto it = map.find(key);
+        return it == map.end() ? npos : it->second;
     }
 
-    // -- stack_data -- //
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    const K& hash_index<K, Alloc, Hash, KeyEqual>::key(handle_t entry) const noexcept {
+        return entry->first;
+    }
 
-    template <class K, class V>
-    stack<K, V>::stack_data::stack_data() {}
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    size_t hash_index<K, Alloc, Hash, KeyEqual>::slot(handle_t entry) const noexcept {
+        return entry->second;
+    }
 
-    template <class K, class V>
-    stack<K, V>::stack_data::stack_data(stack_data&& other) noexcept
-            : stack_list(std::move(other.stack_list))
-            , key_map(std::move(other.key_map)) {}
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    template <class F>
+    void hash_index<K, Alloc, Hash, KeyEqual>::for_each(F&& f) {
+        for (auto& entry : map)
+            f(&entry, entry.second);
+    }
 
-    template <class K, class V>
-    stack<K, V>::stack_data::stack_data(const stack_data& other) {
-        // We have to make a deep copy.
-        std::map<K, typename value_list_t::iterator> next_value;
-        for (auto& el : other.stack_list) {
-            // Retrieve the (key, value) pair.
-            auto& value_data = *el.lock();
-            const K& key = value_data.it->first;
-            auto it = next_value.find(key);
-            if (it == next_value.end()) {
-                it = next_value.insert({key, value_data.list.begin()}).first;
-            }
-            push(key, it->second->value);
-            ++it->second;
-        }
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    hash_index<K, Alloc, Hash, KeyEqual>::const_iterator
+    hash_index<K, Alloc, Hash, KeyEqual>::begin() const {
+        sort_view();
+        return view.cbegin();
     }
 
-    template <class K, class V>
-    void stack<K, V>::stack_data::push(const K& key, const V& value) {
-        // Append to stack list [member modified].
-        stack_list.push_back(std::weak_ptr<value_data_t>());
-        auto stack_it = stack_list.end(); --stack_it;
-        try {
-            // Create a new value element.
-            element_t new_el(value, stack_it);
-            // Create a new value data object
-            // if one doesn't already exist.
-            auto it = key_map.find(key);
-            std::shared_ptr<value_data_t> ptr;
-            if (it == key_map.end()) {
-                ptr = std::make_shared<value_data_t>();
-                ptr->list.push_back(new_el);
-                // Insert to key_map [member modified].
-                ptr->it = key_map.insert({key, ptr}).first;
-            } else {
-                ptr = it->second;
-                // Insert new element to list [member modified].
-                ptr->list.push_back(new_el);
-            }
-            *stack_it = std::weak_ptr<value_data_t>(ptr); // nothrow
-        } catch(...) {
-            // Rollback stack_list change.
-            stack_list.pop_back();
-            throw;
-        }
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    hash_index<K, Alloc, Hash, KeyEqual>::const_iterator
+    hash_index<K, Alloc, Hash, KeyEqual>::end() const {
+        sort_view();
+        return view.cend();
     }
 
-    template <class K, class V>
-    void stack<K, V>::stack_data::pop() {
-        if (size() == 0)
-            throw std::invalid_argument("Tried to use pop() on empty stack.");
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    template <class Q>
+    hash_index<K, Alloc, Hash, KeyEqual>::const_iterator
+    hash_index<K, Alloc, Hash, KeyEqual>::lower_bound(const Q& key) const {
+        sort_view();
+        return std::lower_bound(view.cbegin(), view.cend(), key,
+                                [](const value_type* entry, const Q& key) {
+            return entry->first < key;
+        });
+    }
 
-        // We're locking the value_data.
-        auto last = stack_list.back().lock();
-        last->list.pop_back(); // nothrow
-        if (last->list.empty()) {
-            // Remove the key from the map.
-            // (Doesn't deallocate the value_data just yet).
-            key_map.erase(last->it); // nothrow
-        }
-        stack_list.pop_back(); // nothrow
-        // The value_data is deallocated if needed along with
-        // the last's last breath.
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    template <class Q>
+    hash_index<K, Alloc, Hash, KeyEqual>::const_iterator
+    hash_index<K, Alloc, Hash, KeyEqual>::upper_bound(const Q& key) const {
+        sort_view();
+        return std::upper_bound(view.cbegin(), view.cend(), key,
+                                [](const Q& key, const value_type* entry) {
+            return key < entry->first;
+        });
     }
 
-    template <class K, class V>
-    void stack<K, V>::stack_data::pop(const K& k) {
-        if (size() == 0)
-            throw std::invalid_argument("Tried to use pop(const K& k) on empty stack.");
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    const K& hash_index<K, Alloc, Hash, KeyEqual>::key_at(const_iterator it) noexcept {
+        return (*it)->first;
+    }
 
-        auto last_with_key = key_map.find(k);
-        if(last_with_key == key_map.end())
-            throw std::invalid_argument("Tried to use pop(const K& k) on stack with no key k.");
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    size_t hash_index<K, Alloc, Hash, KeyEqual>::slot_at(const_iterator it) noexcept {
+        return (*it)->second;
+    }
+
+    template <class K, class Alloc, class Hash, class KeyEqual>
+    void hash_index<K, Alloc, Hash, KeyEqual>::sort_view() const {
+        if (view_valid.load(std::memory_order_acquire)) return;
+        // Other copies sharing the index may be sorting it too.
+        std::lock_guard<std::mutex> guard(sorting);
+        if (view_valid.load(std::memory_order_relaxed)) return;
+        // There is enough capacity for every key.
+        view.clear();
+        for (auto& entry : map)
+            view.push_back(&entry);
+        std::sort(view.begin(), view.end(), [](const value_type* a, const value_type* b) {
+            return a->first < b->first;
+        });
+        view_valid.store(true, std::memory_order_release);
+    }
+
+    // -- flat_index -- //
+
+    template <class K, class Alloc>
+    flat_index<K, Alloc>::flat_index(const Alloc& alloc)
+            : keys(alloc)
+            , entries(alloc) {}
+
+    template <class K, class Alloc>
+    flat_index<K, Alloc>::flat_index(const flat_index& other, const Alloc& alloc)
+            : keys(other.keys, alloc)
+            , entries(other.entries, alloc) {
+        // Point the entries at the copied keys.
+        for (auto& entry : entries)
+            entry.first = &*keys[entry.second];
+    }
+
+    template <class K, class Alloc>
+    template <class KeyArg>
+    std::pair<typename flat_index<K, Alloc>::handle_t, bool>
+    flat_index<K, Alloc>::try_emplace(KeyArg&& key, size_t slot) {
+        auto it = lower_bound(key);
+        if (it != entries.end() && !(key < *it->first))
+            return {it->second, false};
+
+        size_t pos = it - entries.cbegin();
+        if (entries.capacity() < entries.size() + 1)
+            entries.reserve(std::max(entries.size() + 1, entries.capacity() * 2));
+        size_t keys_size = keys.size();
+        try {
+            while (keys.size() <= slot)
+                keys.emplace_back();
+            keys[slot].emplace(std::forward<KeyArg>(key));
+        } catch(...) {
+            keys.resize(keys_size);
+            throw;
+        }
+        // The capacity was reserved and entries are trivially copyable.
+        entries.insert(entries.begin() + pos, entry_t(&*keys[slot], slot));
+        return {slot, true};
+    }
+
+    template <class K, class Alloc>
+    void flat_index<K, Alloc>::erase(handle_t slot) noexcept {
+        entries.erase(lower_bound(*keys[slot]));
+        keys[slot].reset();
+    }
+
+    template <class K, class Alloc>
+    void flat_index<K, Alloc>::clear() noexcept {
+        entries.clear();
+        keys.clear();
+    }
+
+    template <class K, class Alloc>
+    void flat_index<K, Alloc>::reserve(size_t n) {
+        entries.reserve(n);
+    }
+
+    template <class K, class Alloc>
+    template <class Q>
+    size_t flat_index<K, Alloc>::find(const Q& key) const {
+        auto it = lower_bound(key);
+        if (it == entries.end() || key < *it->first) return npos;
+        return it->second;
+    }
+
+    template <class K, class Alloc>
+    const K& flat_index<K, Alloc>::key(handle_t slot) const noexcept {
+        return *keys[slot];
+    }
+
+    template <class K, class Alloc>
+    size_t flat_index<K, Alloc>::slot(handle_t slot) const noexcept {
+        return slot;
+    }
+
+    template <class K, class Alloc>
+    template <class F>
+    void flat_index<K, Alloc>::for_each(F&& f) {
+        for (auto& entry : entries)
+            f(entry.second, entry.second);
+    }
+
+    template <class K, class Alloc>
+    flat_index<K, Alloc>::const_iterator flat_index<K, Alloc>::begin() const noexcept {
+        return entries.cbegin();
+    }
+
+    template <class K, class Alloc>
+    flat_index<K, Alloc>::const_iterator flat_index<K, Alloc>::end() const noexcept {
+        return entries.cend();
+    }
+
+    template <class K, class Alloc>
+    const K& flat_index<K, Alloc>::key_at(const_iterator it) noexcept {
+        return *it->first;
+    }
+
+    template <class K, class Alloc>
+    size_t flat_index<K, Alloc>::slot_at(const_iterator it) noexcept {
+        return it->second;
+    }
+
+    template <class K, class Alloc>
+    template <class Q>
+    flat_index<K, Alloc>::const_iterator
+    flat_index<K, Alloc>::lower_bound(const Q& key) const {
+        return std::lower_bound(entries.cbegin(), entries.cend(), key,
+                                [](const entry_t& entry, const Q& key) {
+            return *entry.first < key;
+        });
+    }
+
+    template <class K, class Alloc>
+    template <class Q>
+    flat_index<K, Alloc>::const_iterator
+    flat_index<K, Alloc>::upper_bound(const Q& key) const {
+        return std::upper_bound(entries.cbegin(), entries.cend(), key,
+                                [](const Q& key, const entry_t& entry) {
+            return key < *entry.first;
+        });
+    }
+
+    // -- stack_memory -- //
+
+    inline size_t stack_memory::total() const noexcept {
+        return values + keys + overhead + free;
+    }
+
+    // -- counting_stats -- //
+
+    inline void counting_stats::deep_copy(size_t elements, std::chrono::nanoseconds time) noexcept {
+        ++local.deep_copies;
+        local.deep_copied_elements += elements;
+        local.deep_copy_time += time;
+        add(deep_copies);
+        add(deep_copied_elements, elements);
+        deep_copy_time.fetch_add(time.count(), std::memory_order_relaxed);
+    }
+
+    inline void counting_stats::shared_copy() noexcept {
+        ++local.shared_copies;
+        add(shared_copies);
+    }
+
+    inline void counting_stats::unsharable_transition() noexcept {
+        ++local.unsharable_transitions;
+        add(unsharable_transitions);
+    }
+
+    inline void counting_stats::lookup() noexcept {
+        ++local.lookups;
+        add(lookups);
+    }
+
+    inline void counting_stats::allocation() noexcept {
+        ++local.allocations;
+        add(allocations);
+    }
+
+    inline void counting_stats::upstream_allocation() noexcept {
+        ++local.upstream_allocations;
+        add(upstream_allocations);
+    }
+
+    inline void counting_stats::invalid_argument() noexcept {
+        ++local.invalid_arguments;
+        add(invalid_arguments);
+    }
+
+    inline const stack_stats& counting_stats::snapshot() const noexcept {
+        return local;
+    }
+
+    inline stack_stats counting_stats::global_snapshot() noexcept {
+        stack_stats result;
+        result.deep_copies = deep_copies.load(std::memory_order_relaxed);
+        result.deep_copied_elements = deep_copied_elements.load(std::memory_order_relaxed);
+        result.deep_copy_time = std::chrono::nanoseconds(deep_copy_time.load(std::memory_order_relaxed));
+        result.shared_copies = shared_copies.load(std::memory_order_relaxed);
+        result.unsharable_transitions = unsharable_transitions.load(std::memory_order_relaxed);
+        result.lookups = lookups.load(std::memory_order_relaxed);
+        result.allocations = allocations.load(std::memory_order_relaxed);
+        result.upstream_allocations = upstream_allocations.load(std::memory_order_relaxed);
+        result.invalid_arguments = invalid_arguments.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    inline void counting_stats::add(counter_t& counter, size_t n) noexcept {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // -- local_ptr -- //
+
+    template <class T>
+    local_ptr<T>::local_ptr() noexcept
+            : block(nullptr) {}
+
+    template <class T>
+    local_ptr<T>::local_ptr(std::nullptr_t) noexcept
+            : block(nullptr) {}
+
+    template <class T>
+    local_ptr<T>::local_ptr(const local_ptr& other) noexcept
+            : block(other.block) {
+        if (block != nullptr) ++block->count;
+    }
+
+    template <class T>
+    local_ptr<T>::local_ptr(local_ptr&& other) noexcept
+            : block(std::exchange(other.block, nullptr)) {}
+
+    template <class T>
+    local_ptr<T>::local_ptr(block_t* block) noexcept
+            : block(block) {}
+
+    template <class T>
+    local_ptr<T>::~local_ptr() {
+        if (block != nullptr && --block->count == 0) delete block;
+    }
+
+    template <class T>
+    local_ptr<T>& local_ptr<T>::operator=(local_ptr other) noexcept {
+        std::swap(block, other.block);
+        return *this;
+    }
+
+    template <class T>
+    template <class... Args>
+    local_ptr<T> local_ptr<T>::make(Args&&... args) {
+        return local_ptr(new block_t(std::forward<Args>(args)...));
+    }
+
+    template <class T>
+    T& local_ptr<T>::operator*() const noexcept {
+        return block->value;
+    }
+
+    template <class T>
+    T* local_ptr<T>::operator->() const noexcept {
+        return &block->value;
+    }
+
+    template <class T>
+    long local_ptr<T>::use_count() const noexcept {
+        return block != nullptr ? block->count : 0;
+    }
+
+    template <class T>
+    template <class... Args>
+    local_ptr<T>::block_t::block_t(Args&&... args)
+            : value(std::forward<Args>(args)...)
+            , count(1) {}
+
+    // -- background_reclaimer -- //
+
+    template <class T>
+    void background_reclaimer::retire(T object) noexcept {
+        try {
+            if (worker_t* w = worker()) {
+                // The holder is only deleted by the worker.
+                w->push(new holder_t<T>(std::move(object)));
+            }
+        } catch (...) {
+            // The object is destroyed right here.
+        }
+    }
+
+    inline void background_reclaimer::drain() {
+        if (worker_t* w = worker()) w->drain();
+    }
+
+    inline background_reclaimer::worker_t* background_reclaimer::worker() {
+        if (stopped.load(std::memory_order_acquire)) return nullptr;
+        static worker_t instance;
+        return &instance;
+    }
+
+    template <class T>
+    background_reclaimer::holder_t<T>::holder_t(T&& object) noexcept
+            : object(std::move(object)) {}
+
+    inline background_reclaimer::worker_t::worker_t()
+            : lock()
+            , wake()
+            , done()
+            , queue(nullptr)
+            , pushed(0)
+            , destroyed(0)
+            , stopping(false)
+            , thread() {
+        // Started last, once every member is ready.
+        thread = std::thread([this] { run(); });
+    }
+
+    inline background_reclaimer::worker_t::~worker_t() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        // Later retires destroy their objects right away.
+        stopped.store(true, std::memory_order_release);
+        wake.notify_one();
+        thread.join();
+        // The thread has destroyed everything pushed before it saw
+        // stopping, but not what came after that.
+        retired_t* rest;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            rest = std::exchange(queue, nullptr);
+        }
+        while (rest != nullptr)
+            delete std::exchange(rest, rest->next);
+    }
+
+    inline void background_reclaimer::worker_t::push(retired_t* retired) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            retired->next = queue;
+            queue = retired;
+            ++pushed;
+        }
+        wake.notify_one();
+    }
+
+    inline void background_reclaimer::worker_t::drain() {
+        std::unique_lock<std::mutex> guard(lock);
+        uint64_t target = pushed;
+        done.wait(guard, [&] { return destroyed >= target; });
+    }
+
+    inline void background_reclaimer::worker_t::run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this] { return stopping || queue != nullptr; });
+            if (queue == nullptr) return;
+            // Destroy the whole batch without holding the lock.
+            retired_t* batch = std::exchange(queue, nullptr);
+            guard.unlock();
+            uint64_t count = 0;
+            while (batch != nullptr) {
+                delete std::exchange(batch, batch->next);
+                ++count;
+            }
+            guard.lock();
+            destroyed += count;
+            done.notify_all();
+        }
+    }
+
+    // -- stack_image -- //
+
+    template <class K, class V>
+    size_t stack_image<K, V>::size(size_t keys, size_t elements) noexcept {
+        return elements_offset(keys) + elements * sizeof(element_t);
+    }
+
+    template <class K, class V>
+    stack_image<K, V>::stack_image(std::span<const std::byte> image) {
+        if (image.size() < sizeof(header_t)) malformed();
+        header_t header;
+        std::memcpy(&header, image.data(), sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0
+                || header.key_size != sizeof(K) || header.value_size != sizeof(V)
+                // Positions take 32 bits.
+                || header.keys > header.elements || header.elements > UINT32_MAX
+                || image.size() < size(header.keys, header.elements))
+            malformed();
+        auto address = reinterpret_cast<std::uintptr_t>(image.data());
+        if (address % alignof(key_t) != 0 || address % alignof(element_t) != 0)
+            malformed();
+
+        key_records = {reinterpret_cast<const key_t*>(image.data() + keys_offset()), header.keys};
+        element_records = {
+                reinterpret_cast<const element_t*>(image.data() + elements_offset(header.keys)),
+                header.elements};
+    }
+
+    template <class K, class V>
+    std::span<const typename stack_image<K, V>::key_t> stack_image<K, V>::keys() const noexcept {
+        return key_records;
+    }
+
+    template <class K, class V>
+    std::span<const typename stack_image<K, V>::element_t>
+    stack_image<K, V>::elements() const noexcept {
+        return element_records;
+    }
+
+    template <class K, class V>
+    const typename stack_image<K, V>::key_t* stack_image<K, V>::find(const K& key) const {
+        auto it = std::lower_bound(key_records.begin(), key_records.end(), key,
+                                   [](const key_t& record, const K& k) { return record.key < k; });
+        if (it == key_records.end() || key < it->key) return nullptr;
+        return &*it;
+    }
+
+    template <class K, class V>
+    void stack_image<K, V>::write_header(std::ostream& out, size_t keys, size_t elements) {
+        header_t header{};
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.key_size = sizeof(K);
+        header.value_size = sizeof(V);
+        header.keys = keys;
+        header.elements = elements;
+        // The header has no padding.
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_padding(out, keys_offset() - sizeof(header_t));
+    }
+
+    template <class K, class V>
+    void stack_image<K, V>::write_key(std::ostream& out, const K& key, size_t top, size_t count) {
+        write_record<key_t>(out, key, static_cast<std::uint32_t>(top),
+                            static_cast<std::uint32_t>(count));
+    }
+
+    template <class K, class V>
+    void stack_image<K, V>::write_gap(std::ostream& out, size_t keys) {
+        write_padding(out, elements_offset(keys) - keys_offset() - keys * sizeof(key_t));
+    }
+
+    template <class K, class V>
+    void stack_image<K, V>::write_element(std::ostream& out, const V& value, size_t key) {
+        write_record<element_t>(out, value, static_cast<std::uint32_t>(key));
+    }
+
+    template <class K, class V>
+    void stack_image<K, V>::malformed() {
+        throw std::invalid_argument("Tried to deserialize a malformed stack image.");
+    }
+
+    template <class K, class V>
+    size_t stack_image<K, V>::keys_offset() noexcept {
+        return (sizeof(header_t) + alignof(key_t) - 1) / alignof(key_t) * alignof(key_t);
+    }
+
+    template <class K, class V>
+    size_t stack_image<K, V>::elements_offset(size_t keys) noexcept {
+        size_t end = keys_offset() + keys * sizeof(key_t);
+        return (end + alignof(element_t) - 1) / alignof(element_t) * alignof(element_t);
+    }
+
+    template <class K, class V>
+    template <class T, class... Fields>
+    void stack_image<K, V>::write_record(std::ostream& out, const Fields&... fields) {
+        // Built in zeroed memory, so that the padding is written as zeros.
+        alignas(T) std::byte bytes[sizeof(T)] = {};
+        ::new (static_cast<void*>(bytes)) T{fields...};
+        out.write(reinterpret_cast<const char*>(bytes), sizeof(T));
+    }
+
+    template <class K, class V>
+    void stack_image<K, V>::write_padding(std::ostream& out, size_t n) {
+        static constexpr char zeros[16] = {};
+        for (; n > 0; n -= std::min(n, sizeof(zeros)))
+            out.write(zeros, std::min(n, sizeof(zeros)));
+    }
+
+    // -- stack -- //
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack()
+            : data(make_data())
+            , is_unsharable(false)
+            , guards(0)
+            , size_bound(0)
+            , key_bound(0) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack(stack&& other) noexcept
+            : data(std::move(other.data))
+            , is_unsharable(other.is_unsharable)
+            , guards(0)
+            , size_bound(other.size_bound)
+            , key_bound(other.key_bound) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack(const stack& other)
+            : data(nullptr)
+            , is_unsharable(false)
+            , guards(0)
+            , size_bound(other.size_bound)
+            , key_bound(other.key_bound) {
+        if (other.is_unsharable || other.guards > 0) {
+            // Make a deep copy (should the constructor throw,
+            // no memory will be leaked).
+            data = other.copy_data();
+        } else {
+            // Add another reference.
+            data = other.data;
+            get_data().arena.stats.shared_copy();
+        }
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::~stack() {
+        retire(std::move(data));
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>& stack<K, V, Policy>::operator=(stack other) noexcept {
+        // Since the stack is a temporary copy,
+        // we can now safely swap our contents.
+        swap(*this, other);
+        return *this;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::push(const K& key, const V& value) {
+        push_bounded([&](stack_data& d) { d.emplace(key, value); });
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::push(const K& key, V&& value) {
+        push_bounded([&](stack_data& d) { d.emplace(key, std::move(value)); });
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::push(K&& key, V&& value) {
+        push_bounded([&](stack_data& d) { d.emplace(std::move(key), std::move(value)); });
+    }
+
+    template <class K, class V, class Policy>
+    template <class... Args>
+    void stack<K, V, Policy>::emplace(const K& key, Args&&... args) {
+        push_bounded([&](stack_data& d) { d.emplace(key, std::forward<Args>(args)...); });
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::pop() {
+        auto new_state = make_copy_without([](stack_data& d) {
+            return std::vector<typename stack_data::index_t>{d.top_slot("pop()")};
+        });
+        // A fresh copy has been popped already.
+        if (new_state.first == data) get_data(new_state).pop();
+        assume_state(new_state);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::pop(const K& k) {
+        auto new_state = make_copy_without([&k](stack_data& d) {
+            return std::vector<typename stack_data::index_t>{
+                d.top_slot(k, "pop(const K& k)")};
+        });
+        if (new_state.first == data) get_data(new_state).pop(k);
+        assume_state(new_state);
+    }
+
+    template <class K, class V, class Policy>
+    template <class InputIt>
+    void stack<K, V, Policy>::push_range(InputIt first, InputIt last) {
+        push_bounded([&](stack_data& d) { d.push_range(first, last); });
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::pop_n(size_t n) {
+        auto new_state = make_copy_without([n](stack_data& d) {
+            return d.top_slots(n);
+        });
+        if (new_state.first == data) get_data(new_state).pop_n(n);
+        assume_state(new_state);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::pop_all(const K& k) {
+        auto new_state = make_copy_without([&k](stack_data& d) {
+            return d.key_chain(k, "pop_all(const K& k)");
+        });
+        if (new_state.first == data) get_data(new_state).pop_all(k);
+        assume_state(new_state);
+    }
+
+    template <class K, class V, class Policy>
+    std::pair<const K&, V&> stack<K, V, Policy>::front() {
+        assume_state(make_copy_if_needed(true));
+        return get_data().front();
+    }
+
+    template <class K, class V, class Policy>
+    std::pair<const K&, const V&> stack<K, V, Policy>::front() const {
+        return get_data().front();
+    }
+
+    template <class K, class V, class Policy>
+    V& stack<K, V, Policy>::front(const K& k) {
+        assume_state(make_copy_if_needed(true));
+        return get_data().front(k).second;
+    }
+
+    template <class K, class V, class Policy>
+    const V& stack<K, V, Policy>::front(const K& k) const {
+        return get_data().front(k).second;
+    }
+
+    template <class K, class V, class Policy>
+    bool stack<K, V, Policy>::try_pop() {
+        if (size() == 0) return false;
+        pop();
+        return true;
+    }
+
+    template <class K, class V, class Policy>
+    bool stack<K, V, Policy>::try_pop(const K& k) {
+        if (count(k) == 0) return false;
+        pop(k);
+        return true;
+    }
+
+    template <class K, class V, class Policy>
+    V stack<K, V, Policy>::extract() {
+        if (size() == 0)
+            get_data().reject("Tried to use extract() on empty stack.");
+
+        // Detach first, as that may throw. A copy leaves out the top
+        // element, which is still in the old data.
+        auto new_state = make_copy_without([](stack_data& d) {
+            return std::vector<typename stack_data::index_t>{d.top_slot("extract()")};
+        });
+        bool copied = new_state.first != data;
+        // So that the pop below doesn't throw.
+        if (!copied) get_data().detach_keys(get_data().top_slot("extract()"));
+        V& value = get_data().front().second;
+
+        // Commits once the result has been constructed.
+        struct commit_t {
+            stack& owner;
+            const new_state_t& state;
+            bool copied;
+            int exceptions = std::uncaught_exceptions();
+            ~commit_t() {
+                if (std::uncaught_exceptions() > exceptions) return;
+                if (!copied) owner.get_data(state).pop(); // nothrow
+                owner.assume_state(state);
+            }
+        } commit{*this, new_state, copied};
+        // The value may be moved out of data nobody else shares.
+        if (copied) return V(std::as_const(value));
+        return V(std::move_if_noexcept(value));
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::splice_on_top(stack&& other) {
+        if (&other == this)
+            get_data().reject("Tried to use splice_on_top(stack&& other) with other being the stack itself.");
+        if (other.size() == 0) return;
+
+        // What other is left with, which keeps its statistics.
+        data_ptr_t empty = make_data();
+        empty->arena.stats = other.get_data().arena.stats;
+        if (size() == 0 && guards == 0 && other.guards == 0 && bounds() == std::pair<size_t, size_t>()) {
+            // Just take the data over.
+            retire(std::exchange(data, std::exchange(other.data, std::move(empty))));
+            is_unsharable = std::exchange(other.is_unsharable, false);
+            return;
+        }
+
+        stack_data& from = other.get_data();
+        std::vector<typename stack_data::index_t> slots = from.top_slots(from.size());
+        std::reverse(slots.begin(), slots.end());
+        bool steal = other.data.use_count() == 1;
+        push_bounded([&](stack_data& d) { d.push_from(from, slots, steal); });
+        retire(std::exchange(other.data, std::move(empty)));
+        other.is_unsharable = false;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy> stack<K, V, Policy>::extract_keys(const K& first, const K& last) {
+        stack result;
+        stack_data& d = get_data();
+        std::vector<typename stack_data::index_t> slots = d.key_range(first, last);
+        if (slots.empty()) return result;
+
+        result.get_data().reserve(slots.size(), 0);
+        if (data.use_count() > 1) {
+            result.get_data().push_from(d, slots, false);
+            // As if they had been popped from the top down.
+            assume_state(make_copy_without([&](stack_data&) {
+                return std::vector<typename stack_data::index_t>(slots.rbegin(), slots.rend());
+            }));
+        } else {
+            // So that erasing can't fail once the values have been moved.
+            d.own_keys();
+            result.get_data().push_from(d, slots, true);
+            d.erase(slots); // nothrow
+        }
+        return result;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::pop_bottom() {
+        // Reject before copying.
+        get_data().top_slot("pop_bottom()");
+        auto new_state = make_copy_if_needed(false);
+        get_data(new_state).pop_bottom();
+        assume_state(new_state);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::pop_bottom(const K& k) {
+        get_data().top_slot(k, "pop_bottom(const K& k)");
+        auto new_state = make_copy_if_needed(false);
+        get_data(new_state).pop_bottom(k);
+        assume_state(new_state);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::set_bounds(size_t max_size, size_t max_per_key) {
+        stack_data& d = get_data();
+        bool past = max_size > 0 && d.size() > max_size;
+        for (size_t key = 0; max_per_key > 0 && !past && key < d.key_slots.size(); ++key)
+            past = d.key_slots[key].count > max_per_key;
+        if (past) {
+            auto new_state = make_copy_if_needed(false);
+            stack_data& bounded = get_data(new_state);
+            if (max_size > 0) bounded.own_keys();
+            bounded.evict(max_size, max_per_key, bounded.order.size()); // nothrow
+            assume_state(new_state);
+        }
+        size_bound = max_size;
+        key_bound = max_per_key;
+    }
+
+    template <class K, class V, class Policy>
+    std::pair<size_t, size_t> stack<K, V, Policy>::bounds() const noexcept {
+        return {size_bound, key_bound};
+    }
+
+    template <class K, class V, class Policy>
+    std::optional<std::pair<const K&, V&>> stack<K, V, Policy>::try_front() {
+        if (size() == 0) return std::nullopt;
+        return front();
+    }
+
+    template <class K, class V, class Policy>
+    std::optional<std::pair<const K&, const V&>> stack<K, V, Policy>::try_front() const {
+        if (size() == 0) return std::nullopt;
+        return front();
+    }
+
+    template <class K, class V, class Policy>
+    V* stack<K, V, Policy>::try_front(const K& k) {
+        if (!get_data().try_front(k)) return nullptr;
+        auto new_state = make_copy_if_needed(true);
+        // Look the element up in the (possibly) new data.
+        V* value = &get_data(new_state).try_front(k)->second;
+        assume_state(new_state);
+        return value;
+    }
+
+    template <class K, class V, class Policy>
+    const V* stack<K, V, Policy>::try_front(const K& k) const {
+        auto top = get_data().try_front(k);
+        return top ? &top->second : nullptr;
+    }
+
+    template <class K, class V, class Policy>
+    template <class Q>
+    stack<K, V, Policy>::key_handle stack<K, V, Policy>::find(const Q& k) const {
+        get_data().arena.stats.lookup();
+        return key_handle(get_data().key_map().find(k));
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::count(key_handle handle) const noexcept {
+        auto& key_slots = get_data().key_slots;
+        if (handle.key_slot >= key_slots.size()) return 0;
+        // Released key slots have no elements.
+        return key_slots[handle.key_slot].count;
+    }
+
+    template <class K, class V, class Policy>
+    V& stack<K, V, Policy>::front(key_handle handle) {
+        get_data().key_top_slot(handle.key_slot, "front(key_handle)");
+        assume_state(make_copy_if_needed(true));
+        return get_data().value(get_data().key_top_slot(handle.key_slot, "front(key_handle)"));
+    }
+
+    template <class K, class V, class Policy>
+    const V& stack<K, V, Policy>::front(key_handle handle) const {
+        return get_data().value(get_data().key_top_slot(handle.key_slot, "front(key_handle)"));
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::pop(key_handle handle) {
+        auto new_state = make_copy_without([handle](stack_data& d) {
+            return std::vector<typename stack_data::index_t>{
+                d.key_top_slot(handle.key_slot, "pop(key_handle)")};
+        });
+        if (new_state.first == data) {
+            auto& d = get_data(new_state);
+            typename stack_data::index_t slot = d.key_top_slot(handle.key_slot, "pop(key_handle)");
+            d.detach_keys(slot);
+            d.pop_slot(slot); // nothrow
+        }
+        assume_state(new_state);
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::front_guard stack<K, V, Policy>::modify_front() {
+        // Don't mark the stack, the guard keeps it unshared.
+        auto new_state = make_copy_if_needed(is_unsharable);
+        auto front = get_data(new_state).front();
+        assume_state(new_state);
+        return front_guard(*this, front.first, front.second);
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::front_guard stack<K, V, Policy>::modify_front(const K& k) {
+        auto new_state = make_copy_if_needed(is_unsharable);
+        auto front = get_data(new_state).front(k);
+        assume_state(new_state);
+        return front_guard(*this, front.first, front.second);
+    }
+
+    template <class K, class V, class Policy>
+    template <class F>
+    decltype(auto) stack<K, V, Policy>::update_front(F&& f) {
+        auto guard = modify_front();
+        return std::invoke(std::forward<F>(f), guard.key(), guard.value());
+    }
+
+    template <class K, class V, class Policy>
+    template <class F>
+    decltype(auto) stack<K, V, Policy>::update_front(const K& k, F&& f) {
+        auto guard = modify_front(k);
+        return std::invoke(std::forward<F>(f), guard.key(), guard.value());
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::size() const noexcept {
+        return get_data().size();
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::count(const K& key) const {
+        get_data().arena.stats.lookup();
+        size_t key_slot = get_data().key_map().find(key);
+
+        if (key_slot == stack_data::map_t::npos) return 0;
+        return get_data().key_slots[key_slot].count;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::reserve(size_t elements, size_t keys) {
+        if (data.use_count() > 1) {
+            // Rather than copying the data and then growing the copy.
+            data = copy_data(elements, keys);
+        } else {
+            get_data().reserve(elements, keys);
+        }
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::capacity() const noexcept {
+        return get_data().capacity();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::shrink_to_fit() {
+        // A copy would only be made to be shrunk.
+        if (data.use_count() == 1) get_data().shrink_to_fit();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::clear() {
+        if (data.use_count() > 1 || Policy::reclaimer::deferred) {
+            // Release the resource and create a new empty one,
+            // which keeps the statistics.
+            data_ptr_t fresh = make_data();
+            fresh->arena.stats = get_data().arena.stats;
+            retire(std::exchange(data, std::move(fresh)));
+        } else {
+            get_data().clear();
+        }
+        is_unsharable = false;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator stack<K, V, Policy>::cbegin() const
+            noexcept(noexcept(std::declval<const typename stack_data::map_t&>().begin())) {
+        return const_iterator(get_data().key_map().begin());
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator stack<K, V, Policy>::cend() const
+            noexcept(noexcept(std::declval<const typename stack_data::map_t&>().end())) {
+        return const_iterator(get_data().key_map().end());
+    }
+
+    template <class K, class V, class Policy>
+    template <class Q>
+    stack<K, V, Policy>::const_iterator stack<K, V, Policy>::lower_bound(const Q& k) const {
+        get_data().arena.stats.lookup();
+        return const_iterator(get_data().key_map().lower_bound(k));
+    }
+
+    template <class K, class V, class Policy>
+    template <class Q>
+    stack<K, V, Policy>::const_iterator stack<K, V, Policy>::upper_bound(const Q& k) const {
+        get_data().arena.stats.lookup();
+        return const_iterator(get_data().key_map().upper_bound(k));
+    }
+
+    template <class K, class V, class Policy>
+    template <class Q>
+    std::pair<typename stack<K, V, Policy>::const_iterator, typename stack<K, V, Policy>::const_iterator>
+    stack<K, V, Policy>::equal_range(const Q& k) const {
+        return {lower_bound(k), upper_bound(k)};
+    }
+
+    template <class K, class V, class Policy>
+    template <class Q>
+    size_t stack<K, V, Policy>::rank(const Q& k) const {
+        get_data().arena.stats.lookup();
+        // The iterators of the index itself, which may be random access.
+        const auto& keys = get_data().key_map();
+        return static_cast<size_t>(std::distance(keys.begin(), keys.lower_bound(k)));
+    }
+
+    template <class K, class V, class Policy>
+    const K& stack<K, V, Policy>::nth_key(size_t n) const {
+        if (n >= get_data().key_count())
+            get_data().reject("Tried to use nth_key(size_t n) on stack with at most n keys.");
+
+        const auto& keys = get_data().key_map();
+        return stack_data::map_t::key_at(std::next(keys.begin(), static_cast<std::ptrdiff_t>(n)));
+    }
+
+    template <class K, class V, class Policy>
+    auto stack<K, V, Policy>::elements() const noexcept {
+        stack_data& d = get_data();
+        return std::ranges::subrange<element_iterator>(element_iterator(d, d.order.size()),
+                                                       element_iterator(d, 0));
+    }
+
+    template <class K, class V, class Policy>
+    auto stack<K, V, Policy>::values(const K& key) const {
+        stack_data& d = get_data();
+        d.arena.stats.lookup();
+        size_t key_slot = d.key_map().find(key);
+        value_iterator end(d, stack_data::npos, 0);
+        value_iterator begin = key_slot == stack_data::map_t::npos ? end
+                : value_iterator(d, d.key_slots[key_slot].top, d.key_slots[key_slot].count);
+        return std::ranges::subrange<value_iterator>(begin, end);
+    }
+
+    template <class K, class V, class Policy>
+    const typename stack<K, V, Policy>::stats_t& stack<K, V, Policy>::stats() const noexcept {
+        return get_data().arena.stats;
+    }
+
+    template <class K, class V, class Policy>
+    stack_memory stack<K, V, Policy>::memory_usage() const noexcept {
+        return get_data().memory_usage(data.use_count() > 1);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::serialize(std::ostream& out) const
+            requires std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V> {
+        get_data().serialize(out);
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy> stack<K, V, Policy>::deserialize(std::istream& in)
+            requires std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V> {
+        using image_t = stack_image<K, V>;
+        // Units of std::max_align_t, so that the records are aligned.
+        std::vector<std::max_align_t> buffer(
+                (sizeof(typename image_t::header_t) + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+        auto read = [&](size_t from, size_t to) {
+            in.read(reinterpret_cast<char*>(buffer.data()) + from, to - from);
+            if (static_cast<size_t>(in.gcount()) != to - from) image_t::malformed();
+        };
+        read(0, sizeof(typename image_t::header_t));
+        typename image_t::header_t header;
+        std::memcpy(&header, buffer.data(), sizeof(header));
+        // Checked properly below, but make sure that it is a header
+        // for these types before trusting its counts.
+        if (std::memcmp(header.magic, image_t::magic, sizeof(image_t::magic)) != 0
+                || header.key_size != sizeof(K) || header.value_size != sizeof(V)
+                || header.keys > header.elements || header.elements > UINT32_MAX)
+            image_t::malformed();
+        size_t size = image_t::size(header.keys, header.elements);
+        // Grow the buffer only as the bytes arrive, so that the counts
+        // of a corrupt header can't make it bigger than twice the stream.
+        constexpr size_t chunk = 64 * 1024;
+        for (size_t have = sizeof(header); have < size;) {
+            size_t next = std::min(size, std::max(chunk, have * 2));
+            buffer.resize((next + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+            read(have, next);
+            have = next;
+        }
+        return deserialize(std::as_bytes(std::span(buffer)).first(size));
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy> stack<K, V, Policy>::deserialize(std::span<const std::byte> bytes)
+            requires std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V> {
+        stack result;
+        result.data = make_data(stack_image<K, V>(bytes));
+        return result;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::retire(data_ptr_t old) noexcept {
+        // The count of data nobody else shares can't change under us.
+        if (Policy::reclaimer::deferred && old.use_count() == 1) {
+            // The data's destructor doesn't use the keys.
+            if (old->table.use_count() > 1) old->table = nullptr;
+            Policy::reclaimer::retire(std::move(old));
+        }
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::swap(stack& a, stack& b) noexcept {
+        // This swap omits the need for move assignment
+        // in stack<K, V>.
+        std::swap(a.data, b.data);
+        std::swap(a.is_unsharable, b.is_unsharable);
+        std::swap(a.size_bound, b.size_bound);
+        std::swap(a.key_bound, b.key_bound);
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data& stack<K, V, Policy>::get_data() const noexcept {
+        return *data;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data&
+    stack<K, V, Policy>::get_data(const new_state_t& state) const noexcept {
+        return *state.first;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::assume_state(const new_state_t& state) noexcept {
+        std::tie(data, is_unsharable) = state;
+    }
+
+    template <class K, class V, class Policy>
+    template <class... Args>
+    stack<K, V, Policy>::data_ptr_t stack<K, V, Policy>::make_data(Args&&... args) {
+        if constexpr (std::is_same_v<data_ptr_t, std::shared_ptr<stack_data>>) {
+            return std::make_shared<stack_data>(std::forward<Args>(args)...);
+        } else {
+            return data_ptr_t::make(std::forward<Args>(args)...);
+        }
+    }
+
+    template <class K, class V, class Policy>
+    template <class... Args>
+    stack<K, V, Policy>::data_ptr_t stack<K, V, Policy>::copy_data(Args&&... args) const {
+        if constexpr (stats_t::enabled) {
+            auto start = std::chrono::steady_clock::now();
+            data_ptr_t copy = make_data(get_data(), std::forward<Args>(args)...);
+            copy->arena.stats.deep_copy(copy->size(), std::chrono::steady_clock::now() - start);
+            return copy;
+        } else {
+            return make_data(get_data(), std::forward<Args>(args)...);
+        }
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::new_state_t
+    stack<K, V, Policy>::make_copy_if_needed(bool mark_unshared) const {
+        // The problem specification states that we
+        // must *always* assume mark_unshared, even if
+        // we run at risk of having a rogue reference
+        // to multiple data instances (it's the user's
+        // responsibility not to use such reference).
+        new_state_t state{data.use_count() > 1 ? copy_data() : data, mark_unshared};
+        if (mark_unshared && !is_unsharable)
+            get_data(state).arena.stats.unsharable_transition();
+        return state;
+    }
+
+    template <class K, class V, class Policy>
+    template <class F>
+    stack<K, V, Policy>::new_state_t
+    stack<K, V, Policy>::make_copy_without(F&& removed) const {
+        if (data.use_count() > 1) {
+            // Don't copy what is about to be popped anyway.
+            return {copy_data(removed(get_data())), false};
+        }
+        return {data, false};
+    }
+
+    template <class K, class V, class Policy>
+    template <class F>
+    void stack<K, V, Policy>::push_bounded(F&& push) {
+        auto new_state = make_copy_if_needed(false);
+        stack_data& d = get_data(new_state);
+        // Evicting may remove keys, which then can't fail.
+        if (size_bound > 0) d.own_keys();
+        size_t old_size = d.size();
+        push(d);
+        if (size_bound > 0 || key_bound > 0)
+            d.evict(size_bound, key_bound, d.size() - old_size); // nothrow
+        assume_state(new_state);
+    }
+
+    // -- node_arena -- //
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::node_arena::node_arena(size_t initial_capacity, const stats_t& stats) noexcept
+            : stats(stats)
+            , upstream()
+            , free_lists()
+            , slabs(nullptr)
+            , cursor(nullptr)
+            , limit(nullptr)
+            , next_slab_units(std::max(min_slab_units, units_for(initial_capacity) + header_units))
+            , in_use(0)
+            , obtained(0)
+            , large(0) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::node_arena::~node_arena() {
+        while (slabs != nullptr) {
+            slab_t* next = slabs->next;
+            size_t units = slabs->units;
+            std::allocator_traits<upstream_t>::deallocate(
+                    upstream, reinterpret_cast<unit_t*>(slabs), units);
+            slabs = next;
+        }
+    }
+
+    template <class K, class V, class Policy>
+    void* stack<K, V, Policy>::node_arena::allocate(size_t size, size_t alignment) {
+        stats.allocation();
+        size_t units = units_for(size);
+        if (units > max_pooled_units || alignment > alignof(unit_t)) {
+            void* res = std::allocator_traits<upstream_t>::allocate(upstream, units);
+            stats.upstream_allocation();
+            in_use += units * unit_size;
+            obtained += units * unit_size;
+            large += units * unit_size;
+            return res;
+        }
+
+        block_t*& free_list = free_lists[units - 1];
+        if (free_list != nullptr) {
+            // Recycle a previously deallocated block.
+            block_t* res = free_list;
+            free_list = res->next;
+            in_use += units * unit_size;
+            return res;
+        }
+
+        if (static_cast<size_t>(limit - cursor) < units)
+            add_slab(units);
+        unit_t* res = cursor;
+        cursor += units;
+        in_use += units * unit_size;
+        return res;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::node_arena::deallocate(void* ptr, size_t size,
+                                                     size_t alignment) noexcept {
+        size_t units = units_for(size);
+        in_use -= units * unit_size;
+        if (units > max_pooled_units || alignment > alignof(unit_t)) {
+            std::allocator_traits<upstream_t>::deallocate(
+                    upstream, static_cast<unit_t*>(ptr), units);
+            obtained -= units * unit_size;
+            large -= units * unit_size;
+            return;
+        }
+        // Keep the block for later.
+        block_t* block = static_cast<block_t*>(ptr);
+        block->next = free_lists[units - 1];
+        free_lists[units - 1] = block;
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::node_arena::bytes_in_use() const noexcept {
+        return in_use;
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::node_arena::bytes_obtained() const noexcept {
+        return obtained;
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::node_arena::bytes_pooled() const noexcept {
+        return in_use - large;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::node_arena::reserve(size_t size) {
+        size_t units = units_for(size);
+        if (size > 0 && static_cast<size_t>(limit - cursor) < units)
+            add_slab(units);
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::node_arena::units_for(size_t size) noexcept {
+        // Zero-sized requests still get a distinct block.
+        return std::max<size_t>(1, (size + unit_size - 1) / unit_size);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::node_arena::add_slab(size_t units) {
+        size_t slab_units = std::max(next_slab_units, units + header_units);
+        unit_t* mem = std::allocator_traits<upstream_t>::allocate(upstream, slab_units);
+        stats.upstream_allocation();
+        obtained += slab_units * unit_size;
+        // The remainder of the previous slab is abandoned.
+        slab_t* slab = reinterpret_cast<slab_t*>(mem);
+        slab->next = slabs;
+        slab->units = slab_units;
+        slabs = slab;
+        cursor = mem + header_units;
+        limit = mem + slab_units;
+        // Grow geometrically, so that the number of slabs is logarithmic.
+        next_slab_units = slab_units * 2;
+    }
+
+    // -- arena_allocator -- //
+
+    template <class K, class V, class Policy>
+    template <class T>
+    stack<K, V, Policy>::arena_allocator<T>::arena_allocator(node_arena& arena) noexcept
+            : pool(&arena) {}
+
+    template <class K, class V, class Policy>
+    template <class T>
+    template <class U>
+    stack<K, V, Policy>::arena_allocator<T>::arena_allocator(const arena_allocator<U>& other) noexcept
+            : pool(&other.arena()) {}
+
+    template <class K, class V, class Policy>
+    template <class T>
+    T* stack<K, V, Policy>::arena_allocator<T>::allocate(size_t n) {
+        return static_cast<T*>(pool->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    template <class K, class V, class Policy>
+    template <class T>
+    void stack<K, V, Policy>::arena_allocator<T>::deallocate(T* ptr, size_t n) noexcept {
+        pool->deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+
+    template <class K, class V, class Policy>
+    template <class T>
+    stack<K, V, Policy>::node_arena&
+    stack<K, V, Policy>::arena_allocator<T>::arena() const noexcept {
+        return *pool;
+    }
+
+    template <class K, class V, class Policy>
+    template <class T>
+    template <class U>
+    bool stack<K, V, Policy>::arena_allocator<T>::operator==(const arena_allocator<U>& other) const noexcept {
+        return pool == &other.arena();
+    }
+
+    // -- stack_data -- //
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::stack_data()
+            : arena()
+            , slots(allocator_t<slot_t>(arena))
+            , free_slots(allocator_t<index_t>(arena))
+            , key_slots(allocator_t<key_slot_t>(arena))
+            , free_key_slots(allocator_t<index_t>(arena))
+            , order(allocator_t<index_t>(arena))
+            , holes(0)
+            , bottom(0)
+            , table(make_table())
+            , top_key(nullptr)
+            , top_value(nullptr) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::stack_data(const stack_data& other)
+            : stack_data(other, 0, 0) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::stack_data(
+            const stack_data& other, size_t elements, size_t keys)
+            // Reserve the copy's small blocks up front (the
+            // big arrays come straight from the allocator).
+            : arena(other.arena.bytes_pooled(), other.arena.stats)
+            // Every array is allocated once, with its final capacity.
+            , slots(copy_slots(other.slots, other.slots.size() + other.room(elements), {},
+                               allocator_t<slot_t>(arena)))
+            , free_slots(copy_of(other.free_slots, other.slots.size() + other.room(elements),
+                                 allocator_t<index_t>(arena)))
+            , key_slots(copy_of(other.key_slots, other.key_slots.size() + other.key_room(keys),
+                                allocator_t<key_slot_t>(arena)))
+            , free_key_slots(copy_of(other.free_key_slots, other.key_slots.size() + other.key_room(keys),
+                                     allocator_t<index_t>(arena)))
+            , order(copy_of(other.order, other.order.size() + other.room(elements),
+                            allocator_t<index_t>(arena)))
+            , holes(other.holes)
+            , bottom(other.bottom)
+            // The keys are only copied to make room for more.
+            , table(other.table)
+            , top_key(nullptr)
+            , top_value(nullptr) {
+        if (keys > key_count()) own_keys(keys);
+        refresh_top();
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::stack_data(
+            const stack_data& other, const std::vector<index_t>& removed)
+            : arena(other.arena.bytes_pooled(), other.arena.stats)
+            // Every slot keeps its index.
+            , slots(copy_slots(other.slots, 0, removed, allocator_t<slot_t>(arena)))
+            , free_slots(other.free_slots, allocator_t<index_t>(arena))
+            , key_slots(other.key_slots, allocator_t<key_slot_t>(arena))
+            , free_key_slots(other.free_key_slots, allocator_t<index_t>(arena))
+            , order(other.order, allocator_t<index_t>(arena))
+            , holes(other.holes)
+            , bottom(other.bottom)
+            , table(other.table)
+            , top_key(nullptr)
+            , top_value(nullptr) {
+        free_slots.reserve(slots.size());
+        free_key_slots.reserve(key_slots.size());
+
+        // A key is removed with all of its elements.
+        std::vector<index_t> keys;
+        keys.reserve(removed.size());
+        for (index_t slot : removed)
+            keys.push_back(element(other.slots[slot]).key);
+        std::sort(keys.begin(), keys.end());
+        for (auto it = keys.begin(); it != keys.end();) {
+            auto next = std::upper_bound(it, keys.end(), *it);
+            if (static_cast<size_t>(next - it) == key_slots[*it].count) {
+                own_keys();
+                break;
+            }
+            it = next;
+        }
+        // The links of the removed elements are only left in other.
+        for (index_t slot : removed) {
+            const element_t& el = element(other.slots[slot]);
+            unlink(el, slot); // nothrow
+            order[el.pos] = npos;
+            ++holes;
+        }
+        trim(); // nothrow
+        compact(); // nothrow
+        refresh_top(); // nothrow
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::stack_data(const stack_image<K, V>& image)
+            : arena()
+            , slots(allocator_t<slot_t>(arena))
+            , free_slots(allocator_t<index_t>(arena))
+            , key_slots(allocator_t<key_slot_t>(arena))
+            , free_key_slots(allocator_t<index_t>(arena))
+            , order(allocator_t<index_t>(arena))
+            , holes(0)
+            , bottom(0)
+            , table(make_table(image.keys().size()))
+            , top_key(nullptr)
+            , top_value(nullptr) {
+        static_assert(compact_storage);
+        auto keys = image.keys();
+        auto elements = image.elements();
+        slots.reserve(elements.size());
+        free_slots.reserve(elements.size());
+        order.reserve(elements.size());
+        key_slots.reserve(keys.size());
+        free_key_slots.reserve(keys.size());
+        key_map().reserve(keys.size());
+
+        // The key slots are the indices of the keys.
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (i > 0 && !(keys[i - 1].key < keys[i].key)) stack_image<K, V>::malformed();
+            auto entry = key_map().try_emplace(keys[i].key, i).first;
+            key_slots.push_back(key_slot_t{entry, npos, npos, 0});
+        }
+        // And the slots are the positions, as there are no holes.
+        for (const auto& el : elements) {
+            if (el.key >= keys.size()) stack_image<K, V>::malformed();
+            key_slot_t& key_data = key_slots[el.key];
+            index_t slot = slots.size();
+            construct(slot, el.key, key_data.top, slot, el.value);
+            order.push_back(slot);
+            if (key_data.count > 0) element(key_data.top).above = slot;
+            else key_data.bottom = slot;
+            key_data.top = slot;
+            ++key_data.count;
+        }
+        // The records may be read in place, so they must agree.
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (key_slots[i].count == 0 || key_slots[i].count != keys[i].count
+                    || key_slots[i].top != keys[i].top)
+                stack_image<K, V>::malformed();
+        }
+        refresh_top();
+    }
 
-        // We're locking the value_data.
-        auto last = last_with_key->second;
-        auto to_del = last->list.back().it;
-        last->list.pop_back(); // nothrow
-        if (last->list.empty()) {
-            // Remove the key from the map.
-            // (Doesn't deallocate the value_data just yet).
-            key_map.erase(last_with_key->second->it); // nothrow
+    template <class K, class V, class Policy>
+    template <class KeyArg, class... Args>
+    void stack<K, V, Policy>::stack_data::emplace(KeyArg&& key, Args&&... args) {
+        if (size() >= max_size)
+            throw std::length_error("Tried to push onto a full stack.");
+
+        // Find the key or create its key slot if it doesn't already exist.
+        // Key slot capacity is reserved up front, so that inserting
+        // to key_map is the only step that can fail.
+        bool fresh = free_key_slots.empty();
+        index_t new_key_slot = fresh ? key_slots.size() : free_key_slots.back();
+        if (fresh) {
+            grow(key_slots, new_key_slot + 1);
+            grow(free_key_slots, new_key_slot + 1);
+        }
+        // A shared key table is only copied for a new key.
+        if (table.use_count() > 1) {
+            arena.stats.lookup();
+            if (key_map().find(key) == map_t::npos) own_keys();
+        }
+        // Insert to key_map [member modified].
+        arena.stats.lookup();
+        auto [entry, inserted] = key_map().try_emplace(std::forward<KeyArg>(key), new_key_slot);
+        if (inserted) {
+            if (fresh) key_slots.emplace_back(); // nothrow
+            else free_key_slots.pop_back(); // nothrow
+            key_slots[new_key_slot] = key_slot_t{entry, npos, npos, 0};
+        }
+        index_t key_slot = key_map().slot(entry);
+        key_slot_t& key_data = key_slots[key_slot];
+        index_t pos = order.size();
+        index_t slot;
+        try {
+            grow(order, order.size() + 1);
+            // Construct the value directly in its slot, last,
+            // so that the arguments are only consumed once no
+            // other step can fail [member modified].
+            if (!free_slots.empty()) {
+                slot = free_slots.back();
+                construct(slot, key_slot, key_data.top, pos, std::forward<Args>(args)...);
+                free_slots.pop_back(); // nothrow
+            } else {
+                slot = slots.size();
+                grow(free_slots, slot + 1);
+                construct(slot, key_slot, key_data.top, pos, std::forward<Args>(args)...);
+            }
+        } catch(...) {
+            // Rollback key_map and key_slots change.
+            if (inserted) release_key(key_slot);
+            throw;
         }
-        stack_list.erase(to_del); // nothrow
-        // The value_data is deallocated if needed along with
-        // the last's last breath.
+        // Capacities were reserved, so nothing below throws.
+        order.push_back(slot);
+        if (key_data.count > 0) element(key_data.top).above = slot;
+        else key_data.bottom = slot;
+        key_data.top = slot;
+        ++key_data.count;
+        refresh_top();
     }
 
-    template <class K, class V>
-    std::pair<const K&, V&> stack<K, V>::stack_data::front() {
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::pop() {
+        index_t slot = top_slot("pop()");
+        detach_keys(slot);
+        remove(slot); // nothrow
+        order.pop_back(); // nothrow
+        trim(); // nothrow
+        refresh_top(); // nothrow
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::pop(const K& k) {
+        index_t slot = top_slot(k, "pop(const K& k)");
+        detach_keys(slot);
+        pop_slot(slot); // nothrow
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::pop_n(size_t n) {
+        if (n > size())
+            reject("Tried to use pop_n(size_t n) on stack with fewer than n elements.");
+
+        if (table.use_count() > 1) {
+            // The position of the lowest element popped.
+            size_t lowest = order.size();
+            for (size_t left = n; left > 0;) {
+                if (order[--lowest] != npos) --left;
+            }
+            if (removes_key(lowest)) own_keys();
+        }
+        for (; n > 0; --n) {
+            remove(order.back()); // nothrow
+            order.pop_back(); // nothrow
+            trim(); // nothrow
+        }
+        refresh_top(); // nothrow
+    }
+
+    template <class K, class V, class Policy>
+    template <class InputIt>
+    void stack<K, V, Policy>::stack_data::push_range(InputIt first, InputIt last) {
+        if constexpr (std::forward_iterator<InputIt>) {
+            reserve_for(static_cast<size_t>(std::distance(first, last)));
+        }
+        size_t pushed = 0;
+        try {
+            for (; first != last; ++first, ++pushed) {
+                auto&& element = *first;
+                emplace(element.first, element.second);
+            }
+        } catch (...) {
+            // Rollback the pushed elements.
+            pop_n(pushed); // nothrow
+            throw;
+        }
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::push_from(
+            stack_data& other, const std::vector<index_t>& from, bool steal) {
+        // Trivially copyable values have nothing to move.
+        constexpr bool movable = !compact_storage && std::is_nothrow_move_constructible_v<V>;
+        reserve_for(from.size());
+        size_t pushed = 0;
+        try {
+            for (index_t slot : from) {
+                auto [key, value] = other.entry(slot);
+                if constexpr (movable) {
+                    if (steal) emplace(key, std::move(value));
+                    else emplace(key, std::as_const(value));
+                } else {
+                    emplace(key, std::as_const(value));
+                }
+                ++pushed;
+            }
+        } catch (...) {
+            if constexpr (movable) {
+                // The pushed elements are the topmost positions.
+                for (size_t i = 0; steal && i < pushed; ++i) {
+                    const element_t& el = other.element(from[i]);
+                    index_t key = el.key, below = el.below, above = el.above, pos = el.pos;
+                    other.construct(from[i], key, below, pos,
+                                    std::move(value(order[order.size() - pushed + i])));
+                    other.element(from[i]).above = above;
+                }
+            }
+            // Rollback the pushed elements.
+            pop_n(pushed); // nothrow
+            throw;
+        }
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::erase(const std::vector<index_t>& removed) noexcept {
+        // From the top down, so that each is the topmost with its key.
+        for (auto it = removed.rbegin(); it != removed.rend(); ++it) {
+            order[element(*it).pos] = npos;
+            ++holes;
+            remove(*it);
+        }
+        trim();
+        compact();
+        refresh_top();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::pop_all(const K& k) {
+        index_t slot = top_slot(k, "pop_all(const K& k)");
+        own_keys();
+        key_slot_t& key_data = key_slot(element(slot));
+        // The key slot stays in place after it has been released.
+        for (size_t n = key_data.count; n > 0; --n) {
+            slot = key_data.top;
+            order[element(slot).pos] = npos;
+            ++holes;
+            remove(slot); // nothrow
+        }
+        trim(); // nothrow
+        compact(); // nothrow
+        refresh_top(); // nothrow
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::pop_bottom() {
         if (size() == 0)
-            throw std::invalid_argument("Tried to use front() on empty stack.");
+            reject("Tried to use pop_bottom() on empty stack.");
+
+        index_t slot = bottom_slot();
+        detach_keys(slot);
+        remove_bottom(slot); // nothrow
+        trim(); // nothrow
+        compact(); // nothrow
+        refresh_top(); // nothrow
+    }
 
-        // Otherwise we're good to go and no exceptions will be thrown.
-        auto last = stack_list.back().lock();
-        return {last->it->first, last->list.back().value};
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::pop_bottom(const K& k) {
+        index_t slot = top_slot(k, "pop_bottom(const K& k)");
+        // The only element is the topmost one as well.
+        if (key_slot(element(slot)).count == 1) {
+            detach_keys(slot);
+            pop_slot(slot); // nothrow
+            return;
+        }
+        remove_key_bottom(element(slot).key); // nothrow
+        compact(); // nothrow
+        refresh_top(); // nothrow
     }
 
-    template <class K, class V>
-    V& stack<K, V>::stack_data::front(const K& k) {
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::evict(
+            size_t max_size, size_t max_per_key, size_t n) noexcept {
+        // Positions only change once every hole has been made.
+        if (max_per_key > 0) {
+            for (size_t pos = order.size(); pos-- > order.size() - n;) {
+                if (order[pos] == npos) continue;
+                index_t key = element(order[pos]).key;
+                while (key_slots[key].count > max_per_key)
+                    remove_key_bottom(key);
+            }
+        }
+        if (max_size > 0) {
+            while (size() > max_size)
+                remove_bottom(bottom_slot());
+        }
+        trim();
+        compact();
+        refresh_top();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::reserve_for(size_t n) {
+        grow(order, order.size() + n);
+        grow(free_slots, slots.size() + n);
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::index_t
+    stack<K, V, Policy>::stack_data::top_slot(const char* method) {
+        if (size() == 0)
+            reject(std::string("Tried to use ") + method + " on empty stack.");
+
+        return order.back();
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::index_t
+    stack<K, V, Policy>::stack_data::top_slot(const K& k, const char* method) {
         if (size() == 0)
-            throw std::invalid_argument("Tried to use pop(const K& k) on empty stack.");
+            reject(std::string("Tried to use ") + method + " on empty stack.");
 
-        auto last_with_key = key_map.find(k);
-        if(last_with_key == key_map.end())
-            throw std::invalid_argument("Tried to use pop(const K& k) on stack with no key k.");
+        arena.stats.lookup();
+        size_t last_with_key = key_map().find(k);
+        if(last_with_key == map_t::npos)
+            reject(std::string("Tried to use ") + method + " on stack with no key k.");
 
-        // Otherwise we're good to go and no exceptions will be thrown.
-        return last_with_key->second->list.back().value;
+        return key_slots[last_with_key].top;
     }
 
-    template <class K, class V>
-    void stack<K, V>::stack_data::clear() noexcept {
-        stack_list.clear();
-        key_map.clear();
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::index_t
+    stack<K, V, Policy>::stack_data::key_top_slot(size_t key_slot, const char* method) {
+        if (key_slot >= key_slots.size() || key_slots[key_slot].count == 0)
+            reject(std::string("Tried to use ") + method + " with an invalid key handle.");
+
+        return key_slots[key_slot].top;
     }
 
-    template <class K, class V>
-    size_t stack<K, V>::stack_data::size() noexcept {
-        return stack_list.size();
+    template <class K, class V, class Policy>
+    std::vector<typename stack<K, V, Policy>::stack_data::index_t>
+    stack<K, V, Policy>::stack_data::top_slots(size_t n) {
+        if (n > size())
+            reject("Tried to use pop_n(size_t n) on stack with fewer than n elements.");
+
+        std::vector<index_t> result;
+        result.reserve(n);
+        for (auto it = order.rbegin(); result.size() < n; ++it) {
+            if (*it != npos) result.push_back(*it);
+        }
+        return result;
     }
 
-    template <class K, class V>
-    stack<K, V>::stack_data::element_t::element_t(const V& value, stack_list_t::iterator it)
-            : value(value)
-            , it(it) {}
+    template <class K, class V, class Policy>
+    std::vector<typename stack<K, V, Policy>::stack_data::index_t>
+    stack<K, V, Policy>::stack_data::key_chain(const K& k, const char* method) {
+        index_t slot = top_slot(k, method);
+        std::vector<index_t> result;
+        size_t count = key_slot(element(slot)).count;
+        result.reserve(count);
+        for (; count > 0; --count, slot = element(slot).below) {
+            result.push_back(slot);
+        }
+        return result;
+    }
+
+    template <class K, class V, class Policy>
+    std::vector<typename stack<K, V, Policy>::stack_data::index_t>
+    stack<K, V, Policy>::stack_data::key_range(const K& first, const K& last) {
+        std::vector<index_t> result;
+        if (!(first < last)) return result;
+
+        // Only the keys in the range are visited.
+        const map_t& keys = key_map();
+        for (auto it = keys.lower_bound(first), end = keys.lower_bound(last); it != end; ++it) {
+            size_t key_slot = map_t::slot_at(it);
+            index_t slot = key_slots[key_slot].top;
+            for (size_t n = key_slots[key_slot].count; n > 0; --n, slot = element(slot).below)
+                result.push_back(slot);
+        }
+        std::sort(result.begin(), result.end(), [this](index_t a, index_t b) {
+            return element(a).pos < element(b).pos;
+        });
+        return result;
+    }
+
+    template <class K, class V, class Policy>
+    std::pair<const K&, V&> stack<K, V, Policy>::stack_data::front() {
+        if (top_value == nullptr)
+            reject("Tried to use front() on empty stack.");
+
+        return {*top_key, *top_value};
+    }
+
+    template <class K, class V, class Policy>
+    std::pair<const K&, V&> stack<K, V, Policy>::stack_data::front(const K& k) {
+        element_t& last = element(top_slot(k, "front(const K& k)"));
+        return {key_map().key(key_slot(last).entry), last.value};
+    }
+
+    template <class K, class V, class Policy>
+    std::optional<std::pair<const K&, V&>>
+    stack<K, V, Policy>::stack_data::try_front(const K& k) {
+        arena.stats.lookup();
+        size_t last_with_key = key_map().find(k);
+        if (last_with_key == map_t::npos) return std::nullopt;
+
+        key_slot_t& key_data = key_slots[last_with_key];
+        return std::pair<const K&, V&>(key_map().key(key_data.entry), element(key_data.top).value);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::reject(const std::string& message) {
+        arena.stats.invalid_argument();
+        throw std::invalid_argument(message);
+    }
+
+    template <class K, class V, class Policy>
+    V& stack<K, V, Policy>::stack_data::value(index_t slot) noexcept {
+        return element(slot).value;
+    }
+
+    template <class K, class V, class Policy>
+    std::pair<const K&, V&> stack<K, V, Policy>::stack_data::entry(index_t slot) noexcept {
+        element_t& el = element(slot);
+        return {key_map().key(key_slot(el).entry), el.value};
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::index_t
+    stack<K, V, Policy>::stack_data::below(index_t slot) noexcept {
+        return element(slot).below;
+    }
+
+    template <class K, class V, class Policy>
+    stack_memory stack<K, V, Policy>::stack_data::memory_usage(bool shared) const noexcept {
+        stack_memory memory;
+        // Both live in their arenas, the values in the slots
+        // and the keys in the nodes of the index.
+        memory.values = (order.size() - holes) * sizeof(V);
+        memory.keys = key_count() * sizeof(K);
+        const node_arena& keys_arena = table->arena;
+        size_t data_bytes = sizeof(stack_data) + arena.bytes_obtained();
+        size_t table_bytes = sizeof(key_table) + keys_arena.bytes_obtained();
+        memory.free = arena.bytes_obtained() - arena.bytes_in_use()
+                + keys_arena.bytes_obtained() - keys_arena.bytes_in_use();
+        memory.overhead = data_bytes + table_bytes - memory.free - memory.values - memory.keys;
+        memory.shared = (shared ? data_bytes : 0)
+                + (shared || table.use_count() > 1 ? table_bytes : 0);
+        memory.exclusive = data_bytes + table_bytes - memory.shared;
+        return memory;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::serialize(std::ostream& out) {
+        using image_t = stack_image<K, V>;
+        // The keys in increasing order, with their key slots.
+        std::vector<std::pair<const K*, index_t>> keys;
+        keys.reserve(key_count());
+        key_map().for_each([&](map_t::handle_t entry, index_t key_slot) {
+            keys.emplace_back(&key_map().key(entry), key_slot);
+        });
+        auto less = [](const auto& a, const auto& b) { return *a.first < *b.first; };
+        if (!std::is_sorted(keys.begin(), keys.end(), less))
+            std::sort(keys.begin(), keys.end(), less);
+        std::vector<index_t> key_index(key_slots.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+            key_index[keys[i].second] = i;
+        // The positions of the slots in the stack order without holes.
+        std::vector<index_t> positions(slots.size());
+        index_t position = 0;
+        for (index_t slot : order) {
+            if (slot != npos) positions[slot] = position++;
+        }
+
+        image_t::write_header(out, keys.size(), size());
+        for (auto [key, key_slot] : keys) {
+            const key_slot_t& key_data = key_slots[key_slot];
+            image_t::write_key(out, *key, positions[key_data.top], key_data.count);
+        }
+        image_t::write_gap(out, keys.size());
+        for (index_t slot : order) {
+            if (slot == npos) continue;
+            const element_t& el = element(slot);
+            image_t::write_element(out, el.value, key_index[el.key]);
+        }
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::clear() {
+        // A shared table is left to the other copies.
+        if (table.use_count() > 1) table = make_table();
+        else key_map().clear();
+        order.clear();
+        holes = 0;
+        bottom = 0;
+        free_slots.clear();
+        slots.clear();
+        free_key_slots.clear();
+        key_slots.clear();
+        refresh_top();
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::stack_data::size() noexcept {
+        return order.size() - holes;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::map_t&
+    stack<K, V, Policy>::stack_data::key_map() const noexcept {
+        return table->map;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::reserve(size_t elements, size_t keys) {
+        // Exactly what was asked for, unlike the geometric growth of push.
+        if (size_t extra = room(elements); extra > 0) {
+            order.reserve(order.size() + extra);
+            free_slots.reserve(slots.size() + extra);
+            if constexpr (compact_storage) {
+                slots.reserve(slots.size() + extra);
+                refresh_top();
+            }
+        }
+        if (size_t extra_keys = key_room(keys); extra_keys > 0) {
+            key_slots.reserve(key_slots.size() + extra_keys);
+            free_key_slots.reserve(key_slots.size() + extra_keys);
+            // A shared table is copied with the room.
+            own_keys(keys);
+            key_map().reserve(keys);
+            table->arena.reserve(key_bytes(extra_keys));
+        }
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::shrink_to_fit() {
+        // Copy first, so that a failure leaves every array as it was.
+        indices_t new_order = copy_of(order, order.size(), order.get_allocator());
+        indices_t new_free_slots = copy_of(free_slots, slots.size(), free_slots.get_allocator());
+        key_slots_t new_key_slots = copy_of(key_slots, key_slots.size(), key_slots.get_allocator());
+        indices_t new_free_key_slots = copy_of(free_key_slots, key_slots.size(),
+                                               free_key_slots.get_allocator());
+        if constexpr (compact_storage) {
+            slots_t new_slots = copy_of(slots, slots.size(), slots.get_allocator());
+            slots.swap(new_slots);
+            refresh_top();
+        }
+        // The allocators are equal, so these don't throw.
+        order.swap(new_order);
+        free_slots.swap(new_free_slots);
+        key_slots.swap(new_key_slots);
+        free_key_slots.swap(new_free_key_slots);
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::stack_data::capacity() noexcept {
+        // A push takes a free slot if there is one, or a new one.
+        size_t slots_capacity = free_slots.capacity();
+        if constexpr (compact_storage)
+            slots_capacity = std::min(slots_capacity, slots.capacity());
+        size_t room = std::min(order.capacity() - order.size(),
+                               free_slots.size() + slots_capacity - slots.size());
+        return size() + room;
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::stack_data::key_count() const noexcept {
+        return key_slots.size() - free_key_slots.size();
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::stack_data::room(size_t elements) const noexcept {
+        size_t size = order.size() - holes;
+        return elements > size ? elements - size : 0;
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::stack_data::key_room(size_t keys) const noexcept {
+        return keys > key_count() ? keys - key_count() : 0;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::element_t&
+    stack<K, V, Policy>::stack_data::element(index_t slot) noexcept {
+        return const_cast<element_t&>(element(slots[slot]));
+    }
+
+    template <class K, class V, class Policy>
+    const typename stack<K, V, Policy>::stack_data::element_t&
+    stack<K, V, Policy>::stack_data::element(const slot_t& slot) noexcept {
+        if constexpr (compact_storage) return slot;
+        else return *slot;
+    }
+
+    template <class K, class V, class Policy>
+    template <class... Args>
+    void stack<K, V, Policy>::stack_data::construct(index_t slot, Args&&... args) {
+        if constexpr (compact_storage) {
+            if (slot == slots.size()) slots.emplace_back(std::forward<Args>(args)...);
+            else {
+                // Rebuilt rather than assigned, as V needn't be
+                // assignable. Trivially copyable elements are trivially
+                // destroyed, and the slot is free, so a throwing
+                // constructor loses nothing.
+                std::destroy_at(&slots[slot]);
+                std::construct_at(&slots[slot], std::forward<Args>(args)...);
+            }
+        } else {
+            if (slot == slots.size()) slots.emplace_back(std::in_place, std::forward<Args>(args)...);
+            else slots[slot].emplace(std::forward<Args>(args)...);
+        }
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::key_slot_t&
+    stack<K, V, Policy>::stack_data::key_slot(const element_t& el) noexcept {
+        return key_slots[el.key];
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::remove(index_t slot) noexcept {
+        unlink(element(slot), slot);
+        if constexpr (!compact_storage) slots[slot].reset();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::unlink(const element_t& el, index_t slot) noexcept {
+        key_slot_t& key_data = key_slot(el);
+        key_data.top = el.below;
+        if (--key_data.count == 0) {
+            // Remove the key from the map.
+            release_key(el.key);
+        }
+        // There is enough capacity for every slot.
+        free_slots.push_back(slot);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::pop_slot(index_t slot) noexcept {
+        index_t pos = element(slot).pos;
+        remove(slot);
+        erase_position(pos);
+        refresh_top();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::detach_keys(index_t slot) {
+        if (key_slot(element(slot)).count == 1) own_keys();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::erase_position(index_t pos) noexcept {
+        if (pos + 1 == order.size()) {
+            order.pop_back();
+            trim();
+        } else {
+            // Leave a hole, so that no other position changes.
+            order[pos] = npos;
+            ++holes;
+            compact();
+        }
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::index_t
+    stack<K, V, Policy>::stack_data::bottom_slot() noexcept {
+        // The top is never a hole, so this stops.
+        while (order[bottom] == npos) ++bottom;
+        return order[bottom];
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::remove_bottom(index_t slot) noexcept {
+        element_t& el = element(slot);
+        key_slot_t& key_data = key_slot(el);
+        order[el.pos] = npos;
+        ++holes;
+        if (--key_data.count == 0) {
+            release_key(el.key);
+        } else {
+            // The element above becomes the bottom one.
+            key_data.bottom = el.above;
+            element(el.above).below = npos;
+        }
+        free_slots.push_back(slot);
+        if constexpr (!compact_storage) slots[slot].reset();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::remove_key_bottom(index_t key) noexcept {
+        remove_bottom(key_slots[key].bottom);
+    }
+
+    template <class K, class V, class Policy>
+    bool stack<K, V, Policy>::stack_data::removes_key(size_t lowest) noexcept {
+        for (size_t pos = lowest; pos < order.size(); ++pos) {
+            index_t slot = order[pos];
+            if (slot == npos || key_slot(element(slot)).top != slot) continue;
+            // Walk the key's elements down while they are popped.
+            for (size_t n = key_slot(element(slot)).count; ; --n) {
+                if (n == 1) return true;
+                slot = element(slot).below;
+                if (element(slot).pos < lowest) break;
+            }
+        }
+        return false;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::own_keys(size_t keys) {
+        if (table.use_count() == 1) return;
+
+        key_table_ptr own = make_table(*table, keys);
+        // Only the key slots have to be pointed at the copied map.
+        own->map.for_each([this](map_t::handle_t entry, index_t key_slot) {
+            key_slots[key_slot].entry = entry;
+        });
+        table = std::move(own);
+        // The cached top key is in the table.
+        if (top_key != nullptr) refresh_top();
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::release_key(index_t key_slot) noexcept {
+        // The table is this data's own by now.
+        key_map().erase(key_slots[key_slot].entry);
+        // The erased handle must not outlive its entry, as the slot
+        // is still copied along with the live ones.
+        key_slots[key_slot].entry = {};
+        // There is enough capacity for every key slot.
+        free_key_slots.push_back(key_slot);
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::trim() noexcept {
+        // Keep the top of the stack a valid position.
+        while (!order.empty() && order.back() == npos) {
+            order.pop_back();
+            --holes;
+        }
+        bottom = std::min(bottom, order.size());
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::compact() noexcept {
+        // Only compact once at least half of the positions are holes,
+        // which makes pop(const K&) amortized O(log n).
+        if (holes * 2 <= order.size()) return;
+
+        index_t size = 0;
+        for (index_t slot : order) {
+            if (slot == npos) continue;
+            element(slot).pos = size;
+            order[size++] = slot;
+        }
+        order.resize(size);
+        holes = 0;
+        bottom = 0;
+    }
+
+    template <class K, class V, class Policy>
+    void stack<K, V, Policy>::stack_data::refresh_top() noexcept {
+        if (order.empty()) {
+            top_key = nullptr;
+            top_value = nullptr;
+            return;
+        }
+        element_t& top = element(order.back());
+        top_key = &key_map().key(key_slot(top).entry);
+        top_value = &top.value;
+#if defined(__GNUC__)
+        // The element below is the next top after a pop.
+        if (order.size() > 1 && order[order.size() - 2] != npos)
+            __builtin_prefetch(&element(order[order.size() - 2]));
+#endif
+    }
+
+    template <class K, class V, class Policy>
+    template <class Vector>
+    void stack<K, V, Policy>::stack_data::grow(Vector& vector, size_t n) {
+        // Grow geometrically, so that push stays amortized O(1).
+        if (vector.capacity() < n)
+            vector.reserve(std::max(n, vector.capacity() * 2));
+    }
+
+    template <class K, class V, class Policy>
+    template <class Container>
+    Container stack<K, V, Policy>::stack_data::copy_of(
+            const Container& container, size_t capacity,
+            const typename Container::allocator_type& alloc) {
+        if constexpr (requires (Container& c) { c.reserve(capacity); }) {
+            Container copy(alloc);
+            copy.reserve(std::max(capacity, container.size()));
+            // Inserting a range needs assignable elements, which
+            // compact elements needn't be.
+            if constexpr (std::is_copy_assignable_v<typename Container::value_type>)
+                copy.insert(copy.end(), container.begin(), container.end());
+            else
+                for (const auto& x : container) copy.push_back(x);
+            return copy;
+        } else {
+            return Container(container, alloc);
+        }
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::slots_t stack<K, V, Policy>::stack_data::copy_slots(
+            const slots_t& other, size_t capacity, const std::vector<index_t>& removed,
+            const allocator_t<slot_t>& alloc) {
+        if constexpr (compact_storage) {
+            // Skipping trivial copies isn't worth it, and neither
+            // is spreading a memcpy over threads.
+            return copy_of(other, capacity, alloc);
+        } else {
+            size_t size = other.size();
+            bool parallel = Policy::parallel_copy > 0 && size >= Policy::parallel_copy;
+            if (!parallel && removed.empty()) return copy_of(other, capacity, alloc);
+
+            std::vector<index_t> skipped(removed);
+            std::sort(skipped.begin(), skipped.end());
+            // Fills the slots in [first, last), which are empty.
+            slots_t copy(alloc);
+            auto copy_part = [&](size_t first, size_t last) {
+                auto next = std::lower_bound(skipped.begin(), skipped.end(), first);
+                for (size_t slot = first; slot < last; ++slot) {
+                    if (next != skipped.end() && *next == slot) ++next;
+                    else if (other[slot]) copy[slot].emplace(*other[slot]);
+                }
+            };
+            copy.resize(size);
+            if (!parallel) {
+                copy_part(0, size);
+                return copy;
+            }
+
+            // One part per thread. The copy is only returned once every
+            // part has been copied, and destroyed (on this thread) if
+            // any copy has failed.
+            size_t parts = std::max(1u, std::thread::hardware_concurrency());
+            std::vector<std::exception_ptr> errors(parts);
+            auto run_part = [&](size_t part) noexcept {
+                try {
+                    copy_part(size * part / parts, size * (part + 1) / parts);
+                } catch (...) {
+                    errors[part] = std::current_exception();
+                }
+            };
+            std::vector<std::thread> threads;
+            threads.reserve(parts - 1);
+            for (size_t part = 1; part < parts; ++part) {
+                try {
+                    threads.emplace_back(run_part, part);
+                } catch (...) {
+                    // No more threads to be had, so copy it here.
+                    run_part(part);
+                }
+            }
+            run_part(0);
+            for (std::thread& thread : threads) thread.join();
+            for (std::exception_ptr& error : errors) {
+                if (error) std::rethrow_exception(error);
+            }
+            return copy;
+        }
+    }
+
+    template <class K, class V, class Policy>
+    size_t stack<K, V, Policy>::stack_data::key_bytes(size_t keys) noexcept {
+        // About the size of a tree node holding the key.
+        return keys * (sizeof(K) + sizeof(size_t) + 4 * sizeof(void*));
+    }
+
+    template <class K, class V, class Policy>
+    template <class... Args>
+    stack<K, V, Policy>::stack_data::key_table_ptr
+    stack<K, V, Policy>::stack_data::make_table(Args&&... args) {
+        if constexpr (std::is_same_v<key_table_ptr, std::shared_ptr<key_table>>) {
+            return std::make_shared<key_table>(std::forward<Args>(args)...);
+        } else {
+            return key_table_ptr::make(std::forward<Args>(args)...);
+        }
+    }
+
+    // -- key_table -- //
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::key_table::key_table(size_t keys)
+            : arena(key_bytes(keys))
+            , map(allocator_t<std::byte>(arena)) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::stack_data::key_table::key_table(const key_table& other, size_t keys)
+            : arena(other.arena.bytes_pooled() + key_bytes(keys))
+            // Copying a sorted map takes linear time.
+            , map(other.map, allocator_t<std::byte>(arena)) {
+        // keys is either 0 or more than other has.
+        if (keys > 0) map.reserve(keys);
+    }
+
+    template <class K, class V, class Policy>
+    template <class... Args>
+    stack<K, V, Policy>::stack_data::element_t::element_t(
+            index_t key, index_t below, index_t pos, Args&&... args)
+            : value(std::forward<Args>(args)...)
+            , key(key)
+            , below(below)
+            , above(npos)
+            , pos(pos) {}
+
+    // -- front_guard -- //
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::front_guard::front_guard(stack& owner, const K& key, V& value) noexcept
+            : owner(&owner)
+            , key_ptr(&key)
+            , value_ptr(&value) {
+        ++owner.guards;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::front_guard::front_guard(front_guard&& other) noexcept
+            : owner(other.owner)
+            , key_ptr(other.key_ptr)
+            , value_ptr(other.value_ptr) {
+        other.owner = nullptr;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::front_guard::~front_guard() {
+        // The stack becomes sharable again.
+        if (owner != nullptr) --owner->guards;
+    }
+
+    template <class K, class V, class Policy>
+    const K& stack<K, V, Policy>::front_guard::key() const noexcept {
+        return *key_ptr;
+    }
+
+    template <class K, class V, class Policy>
+    V& stack<K, V, Policy>::front_guard::value() const noexcept {
+        return *value_ptr;
+    }
+
+    // -- key_handle -- //
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::key_handle::key_handle() noexcept
+            : key_slot(npos) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::key_handle::key_handle(size_t key_slot) noexcept
+            : key_slot(key_slot) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::key_handle::operator bool() const noexcept {
+        return key_slot != npos;
+    }
+
+    // -- element_iterator -- //
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::element_iterator::element_iterator() noexcept
+            : data(nullptr)
+            , pos(0) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::element_iterator::element_iterator(stack_data& data, size_t pos) noexcept
+            : data(&data)
+            , pos(pos) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::element_iterator&
+    stack<K, V, Policy>::element_iterator::operator++() noexcept {
+        do {
+            --pos;
+        } while (pos > 0 && data->order[pos - 1] == stack_data::npos);
+        return *this;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::element_iterator
+    stack<K, V, Policy>::element_iterator::operator++(int) noexcept {
+        element_iterator tmp(*this);
+        operator++();
+        return tmp;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::element_iterator&
+    stack<K, V, Policy>::element_iterator::operator--() noexcept {
+        // The top is never a hole, so this stops there at the latest.
+        do {
+            ++pos;
+        } while (data->order[pos - 1] == stack_data::npos);
+        return *this;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::element_iterator
+    stack<K, V, Policy>::element_iterator::operator--(int) noexcept {
+        element_iterator tmp(*this);
+        operator--();
+        return tmp;
+    }
+
+    template <class K, class V, class Policy>
+    std::pair<const K&, const V&> stack<K, V, Policy>::element_iterator::operator*() const noexcept {
+        return data->entry(data->order[pos - 1]);
+    }
+
+    template <class K, class V, class Policy>
+    bool stack<K, V, Policy>::element_iterator::operator==(const element_iterator& iter) const noexcept {
+        return pos == iter.pos;
+    }
+
+    // -- value_iterator -- //
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::value_iterator::value_iterator() noexcept
+            : data(nullptr)
+            , slot(stack_data::npos)
+            , left(0) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::value_iterator::value_iterator(
+            stack_data& data, index_t slot, size_t left) noexcept
+            : data(&data)
+            , slot(slot)
+            , left(left) {}
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::value_iterator&
+    stack<K, V, Policy>::value_iterator::operator++() noexcept {
+        // The bottom value may still be linked to an evicted one.
+        slot = --left == 0 ? stack_data::npos : data->below(slot);
+        return *this;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::value_iterator
+    stack<K, V, Policy>::value_iterator::operator++(int) noexcept {
+        value_iterator tmp(*this);
+        operator++();
+        return tmp;
+    }
+
+    template <class K, class V, class Policy>
+    const V& stack<K, V, Policy>::value_iterator::operator*() const noexcept {
+        return data->value(slot);
+    }
+
+    template <class K, class V, class Policy>
+    const V* stack<K, V, Policy>::value_iterator::operator->() const noexcept {
+        return &data->value(slot);
+    }
+
+    template <class K, class V, class Policy>
+    bool stack<K, V, Policy>::value_iterator::operator==(const value_iterator& iter) const noexcept {
+        return slot == iter.slot;
+    }
 
     // -- const_iterator -- //
 
-    template <class K, class V>
-    stack<K, V>::const_iterator::const_iterator(map_t_it it) noexcept
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator::const_iterator(map_t_it it) noexcept
             : it(it) {}
 
-    template <class K, class V>
-    stack<K, V>::const_iterator::const_iterator(const const_iterator& other) noexcept
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator::const_iterator(const const_iterator& other) noexcept
             : it(other.it) {}
 
-    template <class K, class V>
-    stack<K, V>::const_iterator&
-    stack<K, V>::const_iterator::operator=(const const_iterator& iter) noexcept {
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator&
+    stack<K, V, Policy>::const_iterator::operator=(const const_iterator& iter) noexcept {
         it = iter.it;
+        return *this;
     }
 
-    template <class K, class V>
-    stack<K, V>::const_iterator&
-    stack<K, V>::const_iterator::operator++() noexcept {
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator&
+    stack<K, V, Policy>::const_iterator::operator++() noexcept {
         ++it;
         return *this;
     }
 
-    template <class K, class V>
-    stack<K, V>::const_iterator
-    stack<K, V>::const_iterator::operator++(int) noexcept {
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator
+    stack<K, V, Policy>::const_iterator::operator++(int) noexcept {
         const_iterator tmp(*this);
         operator++();
         return tmp;
     }
 
-    template <class K, class V>
-    bool stack<K, V>::const_iterator::operator==(const const_iterator& iter) const noexcept {
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator&
+    stack<K, V, Policy>::const_iterator::operator--() noexcept {
+        --it;
+        return *this;
+    }
+
+    template <class K, class V, class Policy>
+    stack<K, V, Policy>::const_iterator
+    stack<K, V, Policy>::const_iterator::operator--(int) noexcept {
+        const_iterator tmp(*this);
+        operator--();
+        return tmp;
+    }
+
+    template <class K, class V, class Policy>
+    bool stack<K, V, Policy>::const_iterator::operator==(const const_iterator& iter) const noexcept {
         return it == iter.it;
     }
 
-    template <class K, class V>
-    bool stack<K, V>::const_iterator::operator!=(const const_iterator& iter) const noexcept {
+    template <class K, class V, class Policy>
+    bool stack<K, V, Policy>::const_iterator::operator!=(const const_iterator& iter) const noexcept {
         return !operator==(iter);
     }
 
-    template <class K, class V>
-    const K& stack<K, V>::const_iterator::operator*() const {
-        return it->first;
+    template <class K, class V, class Policy>
+    const K& stack<K, V, Policy>::const_iterator::operator*() const {
+        return stack_data::map_t::key_at(it);
     }
 
-    template <class K, class V>
-    const K* stack<K, V>::const_iterator::operator->() const {
-        return &(it->first);
+    template <class K, class V, class Policy>
+    const K* stack<K, V, Policy>::const_iterator::operator->() const {
+        return &stack_data::map_t::key_at(it);
     }
 }
\ No newline at end of file
@@ -0,0 +1,165 @@
+// Micro-benchmarks of the stack's hot paths.
+//   g++ -O2 -std=c++20 stack_bench.cpp -o stack_bench
+//   ./stack_bench [max size (default 1000000)] [benchmark or index name filter]
+// Prints the mean time per operation (or per element, for deep
+// copies and key iteration) for sizes 1e2, 1e3, ... up to max size,
+// with each key index: the default ordered_index (map), hash_index
+// (hash) and flat_index (flat, only up to 1e4 elements, as it is
+// meant for small key sets). The int and large values are stored
+// compactly, the strings aren't.
+#include "stack.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+
+using cxx::stack;
+
+namespace {
+	using clock_type = std::chrono::steady_clock;
+
+	struct hash_policy : cxx::stack_policy {
+		template <class Key, class Alloc>
+		using key_index = cxx::hash_index<Key, Alloc>;
+	};
+
+	struct flat_policy : cxx::stack_policy {
+		template <class Key, class Alloc>
+		using key_index = cxx::flat_index<Key, Alloc>;
+	};
+
+	// Pushing a key into a flat_index takes linear time in the number
+	// of keys, so bigger sizes would take minutes.
+	constexpr size_t max_flat_size = 10000;
+
+	const char* filter = nullptr;
+
+	// Keeps the compiler from optimizing a result away.
+	template <class T>
+	void keep(const T& x) {
+		asm volatile("" : : "g"(&x) : "memory");
+	}
+
+	struct large {
+		std::array<char, 256> bytes;
+		large(int x) { bytes.fill(static_cast<char>(x)); }
+	};
+
+	template <class V>
+	V make_value(int i) {
+		if constexpr (std::is_same_v<V, std::string>) {
+			// Long enough not to fit in the small string buffer.
+			std::string value = "value #" + std::to_string(i);
+			value.resize(24, '.');
+			return value;
+		} else {
+			return V(i);
+		}
+	}
+
+	// Every key has about four elements, scattered over the stack.
+	int key_of(size_t i, size_t n) {
+		size_t keys = n / 4 + 1;
+		return static_cast<int>(i * 2654435761u % keys);
+	}
+
+	template <class V, class Policy>
+	stack<int, V, Policy> filled(size_t n) {
+		stack<int, V, Policy> s;
+		for (size_t i = 0; i < n; i++) s.push(key_of(i, n), make_value<V>(i));
+		return s;
+	}
+
+	// Prints the time of body(setup()) divided by ops, averaged over
+	// enough rounds for small sizes. Only the body is timed.
+	template <class Setup, class Body>
+	void measure(const char* type, const char* index, const char* name, size_t n, size_t ops,
+			Setup&& setup, Body&& body) {
+		if (filter && !std::strstr(name, filter) && !std::strstr(index, filter)) return;
+		size_t rounds = std::max<size_t>(1, 1000000 / n);
+		std::chrono::duration<double, std::nano> time{0};
+		for (size_t round = 0; round < rounds; round++) {
+			auto state = setup();
+			auto start = clock_type::now();
+			body(state);
+			time += clock_type::now() - start;
+			keep(state);
+		}
+		std::printf("%-8s %-6s %-20s %10zu %12.1f ns\n", type, index, name, n,
+				time.count() / ops / rounds);
+	}
+
+	template <class V, class Policy>
+	void run(const char* type, const char* index, size_t n) {
+		using S = stack<int, V, Policy>;
+		const S s = filled<V, Policy>(n);
+		// Copies of s share its data.
+		auto shared = [&] { return s; };
+		auto fresh = [&] { return filled<V, Policy>(n); };
+
+		measure(type, index, "push", n, n, [] { return S(); }, [&](S& t) {
+			for (size_t i = 0; i < n; i++) t.push(key_of(i, n), make_value<V>(i));
+		});
+		measure(type, index, "front", n, n, shared, [&](const S& t) {
+			for (size_t i = 0; i < n; i++) keep(t.front());
+		});
+		measure(type, index, "front(k)", n, n, shared, [&](const S& t) {
+			for (size_t i = 0; i < n; i++) keep(t.front(key_of(i, n)));
+		});
+		measure(type, index, "count(k)", n, n, shared, [&](const S& t) {
+			for (size_t i = 0; i < n; i++) keep(t.count(key_of(i, n)));
+		});
+		measure(type, index, "key iteration", n, n, shared, [&](const S& t) {
+			for (auto it = t.cbegin(); it != t.cend(); ++it) keep(*it);
+		});
+		measure(type, index, "copy shared", n, n, shared, [&](const S& t) {
+			for (size_t i = 0; i < n; i++) {
+				S copy(t);
+				keep(copy);
+			}
+		});
+		measure(type, index, "copy unsharable", n, n, [&] {
+			S t(s);
+			// The non-const front makes the stack unsharable.
+			t.front();
+			return t;
+		}, [&](const S& t) {
+			S copy(t);
+			keep(copy);
+		});
+		measure(type, index, "cow break", n, n, shared, [&](S& t) {
+			t.push(0, make_value<V>(0));
+		});
+		measure(type, index, "pop", n, n, fresh, [&](S& t) {
+			for (size_t i = 0; i < n; i++) t.pop();
+		});
+		measure(type, index, "pop(k)", n, n, fresh, [&](S& t) {
+			for (size_t i = 0; i < n; i++) t.pop(key_of(i, n));
+		});
+	}
+
+	template <class V>
+	void run_indices(const char* type, size_t n) {
+		run<V, cxx::stack_policy>(type, "map", n);
+		run<V, hash_policy>(type, "hash", n);
+		if (n <= max_flat_size) run<V, flat_policy>(type, "flat", n);
+	}
+}
+
+int main(int argc, char** argv) {
+	size_t max_size = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+	if (argc > 2) filter = argv[2];
+
+	std::printf("%-8s %-6s %-20s %10s %15s\n", "value", "index", "benchmark", "size", "time per op");
+	for (size_t n = 100; n <= max_size; n *= 10) {
+		run_indices<int>("int", n);
+		run_indices<std::string>("string", n);
+		// Skip sizes at which the large values wouldn't fit in memory.
+		if (n * sizeof(large) <= (size_t(1) << 30)) run_indices<large>("large", n);
+	}
+	return 0;
+}
@@ -0,0 +1,397 @@
+// Exception-safety stress test and allocation budget of the stack.
+//   g++ -O1 -std=c++20 stack_stress.cpp -o stack_stress
+//   ./stack_stress
+// Every operation is run once for each of its failure points (the
+// allocations from the policy's allocator and the heap, and the copies
+// of keys and values), failing at that point, and the stack (with the
+// copies sharing its data or keys) must be left exactly as it was.
+// Then the allocations per operation are measured and checked against
+// their budgets. Exits with 1 if anything fails.
+#include "stack.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using cxx::stack;
+
+namespace {
+	// The failure points hit while armed, and the one that throws.
+	bool armed = false;
+	size_t hits = 0;
+	size_t fail_at = 0;
+	// Allocations made from the policy's allocator and the heap.
+	size_t policy_allocations = 0;
+	size_t heap_allocations = 0;
+	bool failed = false;
+
+	template <class Exception>
+	void failure_point() {
+		if (!armed || hits++ != fail_at) return;
+		// Only the first failure is injected, so that the exception
+		// itself (and the rollback) can still allocate.
+		armed = false;
+		throw Exception();
+	}
+
+	struct injected_error : std::runtime_error {
+		injected_error() : std::runtime_error("injected") {}
+	};
+
+	// The upstream allocator of the node arenas.
+	template <class T>
+	struct counting_allocator {
+		using value_type = T;
+
+		counting_allocator() = default;
+		template <class U>
+		counting_allocator(const counting_allocator<U>&) noexcept {}
+
+		T* allocate(size_t n) {
+			failure_point<std::bad_alloc>();
+			++policy_allocations;
+			// Straight from malloc, so that it isn't counted as a heap one.
+			if (void* p = std::malloc(n * sizeof(T))) return static_cast<T*>(p);
+			throw std::bad_alloc();
+		}
+		void deallocate(T* p, size_t) noexcept {
+			std::free(p);
+		}
+
+		template <class U>
+		bool operator==(const counting_allocator<U>&) const noexcept { return true; }
+	};
+
+	struct ordered_policy : cxx::stack_policy {
+		template <class T>
+		using allocator = counting_allocator<T>;
+	};
+
+	struct hash_policy : ordered_policy {
+		template <class Key, class Alloc>
+		using key_index = cxx::hash_index<Key, Alloc>;
+	};
+
+	struct flat_policy : ordered_policy {
+		template <class Key, class Alloc>
+		using key_index = cxx::flat_index<Key, Alloc>;
+	};
+
+	// Keys and values whose copies may fail. The values allocate
+	// their text, so copying them allocates as well.
+	struct fragile_key {
+		int id;
+		fragile_key(int id) : id(id) {}
+		fragile_key(const fragile_key& other) : id(other.id) { failure_point<injected_error>(); }
+		fragile_key& operator=(const fragile_key&) = default;
+		friend bool operator<(const fragile_key& a, const fragile_key& b) { return a.id < b.id; }
+		friend bool operator==(const fragile_key& a, const fragile_key& b) { return a.id == b.id; }
+	};
+
+	struct fragile_value {
+		int id;
+		std::string text;
+		fragile_value(int id) : id(id), text(32, static_cast<char>('a' + id % 26)) {}
+		fragile_value(const fragile_value& other) : id(other.id), text() {
+			failure_point<injected_error>();
+			text = other.text;
+		}
+		fragile_value(fragile_value&&) noexcept = default;
+		fragile_value& operator=(const fragile_value&) = default;
+	};
+
+	int id(int x) { return x; }
+	int id(const fragile_key& k) { return k.id; }
+	int id(const fragile_value& v) { return v.id; }
+}
+
+template <>
+struct std::hash<fragile_key> {
+	size_t operator()(const fragile_key& k) const noexcept { return std::hash<int>()(k.id); }
+};
+
+void* operator new(size_t size) {
+	failure_point<std::bad_alloc>();
+	++heap_allocations;
+	if (void* p = std::malloc(size > 0 ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+
+// GCC can't tell that operator new above is std::malloc too.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	std::free(p);
+}
+#pragma GCC diagnostic pop
+
+namespace {
+	void fail(const char* what, const char* type, const char* name, const char* mode, size_t point) {
+		std::printf("FAILED: %s (%s, %s, %s, failure point %zu)\n", what, type, name, mode, point);
+		failed = true;
+	}
+
+	// What can be observed of a stack: its elements from the bottom
+	// up, and its keys with their counts, front values and bounds.
+	struct state_t {
+		std::vector<std::pair<int, int>> elements;
+		std::vector<std::pair<int, size_t>> keys;
+		std::vector<int> fronts;
+		std::pair<size_t, size_t> bounds;
+
+		bool operator==(const state_t&) const = default;
+	};
+
+	template <class S>
+	state_t state_of(const S& s) {
+		state_t state;
+		for (const auto& [key, value] : s.elements())
+			state.elements.emplace_back(id(key), id(value));
+		std::reverse(state.elements.begin(), state.elements.end());
+		for (auto it = s.cbegin(); it != s.cend(); ++it) {
+			state.keys.emplace_back(id(*it), s.count(*it));
+			state.fronts.push_back(id(s.front(*it)));
+		}
+		state.bounds = s.bounds();
+		return state;
+	}
+
+	// Whether the parts of the state agree with each other.
+	bool consistent(const state_t& state, size_t size) {
+		if (state.elements.size() != size) return false;
+		size_t total = 0;
+		for (size_t i = 0; i < state.keys.size(); ++i) {
+			auto [key, count] = state.keys[i];
+			size_t found = 0;
+			int front = 0;
+			for (auto [k, v] : state.elements) {
+				if (k == key) {
+					++found;
+					front = v;
+				}
+			}
+			if (found != count || count == 0 || front != state.fronts[i]) return false;
+			total += count;
+		}
+		return total == size;
+	}
+
+	template <class S>
+	using key_of = std::remove_cvref_t<decltype(*std::declval<S>().cbegin())>;
+
+	// 41 elements: keys 0 to 7 with five elements each, 8 with one,
+	// and pushed in an interleaved order.
+	template <class S>
+	S fixture() {
+		using K = key_of<S>;
+		S s;
+		for (int i = 0; i < 40; ++i) s.push(K(i * 3 % 8), i);
+		s.push(K(8), 40);
+		return s;
+	}
+
+	template <class S>
+	struct scenario_t {
+		const char* name;
+		// Run before arming the failures.
+		std::function<void(S&, S&)> prepare;
+		// s and a second stack, other.
+		std::function<void(S&, S&)> op;
+	};
+
+	template <class S>
+	std::vector<scenario_t<S>> scenarios() {
+		using K = key_of<S>;
+		auto none = [](S&, S&) {};
+		return {
+			{"push", none, [](S& s, S&) { s.push(K(3), 100); }},
+			{"push new key", none, [](S& s, S&) { s.push(K(20), 100); }},
+			{"emplace", none, [](S& s, S&) { s.emplace(K(5), 100); }},
+			{"pop", none, [](S& s, S&) { s.pop(); }},
+			{"pop(k)", none, [](S& s, S&) { s.pop(K(3)); }},
+			{"pop(k) last", none, [](S& s, S&) { s.pop(K(8)); }},
+			{"pop_n", none, [](S& s, S&) { s.pop_n(7); }},
+			{"pop_all", none, [](S& s, S&) { s.pop_all(K(2)); }},
+			{"push_range", none, [](S& s, S&) {
+				std::vector<std::pair<K, int>> range{{K(1), 101}, {K(30), 102}, {K(4), 103}, {K(31), 104}};
+				s.push_range(range.begin(), range.end());
+			}},
+			{"copy", none, [](S& s, S& other) { other = S(s); }},
+			// The non-const front makes the copy deep.
+			{"deep copy", [](S& s, S&) { s.front(); }, [](S& s, S& other) { other = S(s); }},
+			{"extract", none, [](S& s, S&) { s.extract(); }},
+			{"splice_on_top", [](S&, S& other) {
+				other.push(K(3), 200);
+				other.push(K(40), 201);
+			}, [](S& s, S& other) { s.splice_on_top(std::move(other)); }},
+			{"extract_keys", none, [](S& s, S& other) { other = s.extract_keys(K(2), K(5)); }},
+			{"pop_bottom", none, [](S& s, S&) { s.pop_bottom(); }},
+			{"set_bounds", none, [](S& s, S&) { s.set_bounds(30, 3); }},
+			{"bounded push", [](S& s, S&) { s.set_bounds(41, 5); }, [](S& s, S&) { s.push(K(8), 100); }},
+			{"reserve", none, [](S& s, S&) { s.reserve(100, 30); }},
+			{"shrink_to_fit", none, [](S& s, S&) { s.shrink_to_fit(); }},
+		};
+	}
+
+	// How the stack shares its data: not at all, with a copy of it,
+	// or just its keys with a deep copy.
+	enum class sharing_t { unique, shared, shared_keys };
+	const char* const sharing_names[] = {"unique", "shared", "shared keys"};
+
+	// Runs the scenario failing at every failure point in turn, and
+	// returns the number of failure points.
+	template <class S>
+	size_t run_failures(const char* type, const scenario_t<S>& scenario, sharing_t sharing) {
+		const char* mode = sharing_names[static_cast<int>(sharing)];
+		for (size_t point = 0;; ++point) {
+			S source = fixture<S>();
+			// The non-const front makes the copies deep.
+			if (sharing == sharing_t::shared_keys) source.front();
+			S s(source);
+			S other;
+			scenario.prepare(s, other);
+			// A copy sharing the data (or just the keys) of s.
+			S held;
+			if (sharing == sharing_t::shared) held = s;
+			if (sharing == sharing_t::shared_keys) held = source;
+			state_t before = state_of(s), other_before = state_of(other), held_before = state_of(held);
+
+			hits = 0;
+			fail_at = point;
+			armed = true;
+			bool threw = false;
+			try {
+				scenario.op(s, other);
+			} catch (const std::bad_alloc&) {
+				threw = true;
+			} catch (const injected_error&) {
+				threw = true;
+			}
+			armed = false;
+
+			if (!consistent(state_of(s), s.size()) || !consistent(state_of(other), other.size()))
+				fail("inconsistent state", type, scenario.name, mode, point);
+			if (state_of(held) != held_before)
+				fail("a copy changed", type, scenario.name, mode, point);
+			if (!threw) {
+				// The operation ran to completion, as it does without failures.
+				S expected_s = fixture<S>();
+				S expected_other;
+				scenario.prepare(expected_s, expected_other);
+				scenario.op(expected_s, expected_other);
+				if (state_of(s) != state_of(expected_s) || state_of(other) != state_of(expected_other))
+					fail("wrong result", type, scenario.name, mode, point);
+				return point;
+			}
+			if (state_of(s) != before || state_of(other) != other_before)
+				fail("no strong guarantee", type, scenario.name, mode, point);
+		}
+	}
+
+	template <class K, class V, class Policy>
+	void run_all_failures(const char* type) {
+		using S = stack<K, V, Policy>;
+		for (const auto& scenario : scenarios<S>()) {
+			std::printf("%-28s %-16s", type, scenario.name);
+			for (sharing_t sharing : {sharing_t::unique, sharing_t::shared, sharing_t::shared_keys})
+				std::printf(" %12zu", run_failures(type, scenario, sharing));
+			std::printf("\n");
+		}
+	}
+
+	// Allocations per operation, checked against a budget.
+	void report(const char* type, const char* name, size_t ops,
+			size_t policy, size_t heap, double budget) {
+		double per_op = static_cast<double>(policy + heap) / ops;
+		bool over = per_op > budget;
+		std::printf("%-8s %-24s %12.4f %12.4f %12.4f%s\n", type, name,
+				static_cast<double>(policy) / ops, static_cast<double>(heap) / ops, budget,
+				over ? "  OVER BUDGET" : "");
+		if (over) failed = true;
+	}
+
+	// Counts the allocations made by op(s), ops times on setup().
+	template <class S, class Setup, class Op>
+	void measure(const char* type, const char* name, size_t ops, double budget, Setup&& setup, Op&& op) {
+		S s = setup();
+		size_t policy = policy_allocations, heap = heap_allocations;
+		for (size_t i = 0; i < ops; ++i) op(s, i);
+		report(type, name, ops, policy_allocations - policy, heap_allocations - heap, budget);
+	}
+
+	template <class V>
+	void run_budgets(const char* type, double value_allocations) {
+		using S = stack<int, V, ordered_policy>;
+		constexpr size_t n = 100000;
+		auto empty = [] { return S(); };
+		auto filled = [] {
+			S s;
+			for (size_t i = 0; i < n; ++i) s.push(static_cast<int>(i % 1000), V(i));
+			return s;
+		};
+		// Value copies allocate too, once for each element pushed.
+		measure<S>(type, "push", n, 0.01 + value_allocations, empty, [](S& s, size_t i) {
+			s.push(static_cast<int>(i % 1000), V(i));
+		});
+		// The key arena still takes a slab now and then after reserve.
+		measure<S>(type, "push reserved", n, 0.001 + value_allocations, [] {
+			S s;
+			s.reserve(n, 1000);
+			return s;
+		}, [](S& s, size_t i) { s.push(static_cast<int>(i % 1000), V(i)); });
+		measure<S>(type, "pop", n, 0, filled, [](S& s, size_t) { s.pop(); });
+		measure<S>(type, "pop(k)", n, 0, filled, [](S& s, size_t i) { s.pop(static_cast<int>(i % 1000)); });
+		measure<S>(type, "push and pop new keys", n, value_allocations, [] {
+			S s;
+			s.push(-1, V(0));
+			s.push(-2, V(0));
+			s.pop(-2);
+			return s;
+		}, [](S& s, size_t i) {
+			s.push(static_cast<int>(i), V(i));
+			s.pop();
+		});
+		measure<S>(type, "bounded push", n, 0.001 + value_allocations, [&] {
+			S s = filled();
+			s.set_bounds(n, 100);
+			return s;
+		}, [](S& s, size_t i) { s.push(static_cast<int>(i % 1000), V(i)); });
+		// A deep copy is the stack_data, its arrays (and the slot deque,
+		// unless the storage is compact) and the key arena, and the values.
+		measure<S>(type, "deep copy", 10, 7 + value_allocations * n, [&] {
+			S s = filled();
+			s.front();
+			return s;
+		}, [](S& s, size_t) { S copy(s); });
+		// The push after the copy regrows the arrays, which the copy
+		// only makes as big as they need to be.
+		measure<S>(type, "cow break", 10, 12 + value_allocations * (n + 1), filled, [](S& s, size_t i) {
+			S copy(s);
+			copy.push(static_cast<int>(i), V(i));
+		});
+	}
+}
+
+int main() {
+	std::printf("%-28s %-16s %12s %12s %12s\n", "type", "operation", "unique", "shared", "shared keys");
+	run_all_failures<fragile_key, fragile_value, ordered_policy>("fragile, ordered_index");
+	run_all_failures<fragile_key, fragile_value, hash_policy>("fragile, hash_index");
+	run_all_failures<fragile_key, fragile_value, flat_policy>("fragile, flat_index");
+	run_all_failures<int, int, ordered_policy>("int (compact), ordered_index");
+
+	std::printf("\n%-8s %-24s %12s %12s %12s\n", "value", "operation", "policy /op", "heap /op", "budget");
+	run_budgets<int>("int", 0);
+	run_budgets<fragile_value>("string", 1);
+	if (failed) std::printf("\nFAILED\n");
+	return failed ? 1 : 0;
+}